@@ -5,78 +5,432 @@
 #include <chrono>
 #include <cassert>
 #include <cstring>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "ipc_mpmc.h"
+#include "ipc_sharded.h"
+#include "ipc_growable.h"
+#include "latency_histogram.h"
 
-constexpr size_t queue_size = 1048576;             // Must match default_queue_size in header
-constexpr size_t n_messages = 100'000'000;          // Total messages to send
-constexpr int n_producers = 8;
-constexpr int n_consumers = 8;
+constexpr const char* queue_name    = "/mpmc_demo_queue";
+constexpr const char* control_name  = "/mpmc_demo_control";
+constexpr int         max_producers = 64;
+constexpr int         max_consumers = 64;
 
-struct complex_message_t {
-    int  message_type;
-    bool flag;
-    char content[32];
+struct bench_config_t {
+    bool        processes  = false;         // fork()+exec() workers instead of threads
+    int         producers  = 8;
+    int         consumers  = 8;
+    size_t      messages   = 100'000'000;   // total, split evenly among producers
+    size_t      payload    = 64;            // bytes per message, incl. timestamp
+    size_t      capacity   = 1048576;       // ring capacity, must be a power of 2
+    size_t      lanes      = 1;             // > 1 uses shm_sharded_queue, capacity is per lane
+    size_t      blocks     = 0;             // > 0 uses shm_growable_queue, capacity is per block
+    size_t      batch      = 1;             // > 1 uses enqueue_bulk/dequeue_bulk
+    double      rate       = 0;             // msgs/sec per producer, 0 = as fast as possible
+    bool        tsc        = false;         // timestamp with rdtsc instead of steady_clock
+    std::string layout     = "padded";
+    std::vector<int> cpus;                  // pinned round-robin: producers first, then consumers
+    std::string worker;                     // set in exec()ed children: "producer" or "consumer"
+    int         worker_id  = 0;
 };
 
-std::atomic<size_t> messages_received(0);
+// Every message carries its send timestamp; the rest pads it to the requested size.
+template <size_t Size>
+struct bench_message_t {
+    uint64_t sent;
+    uint32_t producer;
+    uint32_t seq;
+    char     pad[Size - 16];
+};
 
-void producer(size_t id, size_t count) {
-    shm_mpmc_bounded_queue<complex_message_t> q("/mpmc_demo_queue", queue_size);
-    for (size_t i = 0; i < count; ++i) {
-        complex_message_t msg;
-        msg.message_type = 1;
-        msg.flag = false;
-        //std::memset(msg.content, 0, sizeof(msg.content));
-        std::snprintf(msg.content, sizeof(msg.content), "msg-%zu", id, i);
+// What each worker reports back, one slot per producer/consumer.
+struct worker_stats_t {
+    int32_t  pid;
+    uint64_t messages;
+    uint64_t retries;       // polls that found the queue full (producers) or empty (consumers)
+    uint64_t elapsed_ns;
+};
 
-        while (!q.enqueue(msg)) {
-            std::this_thread::yield();
+// Control block in its own named segment, so that exec()ed workers can
+// attach to it the same way they attach to the queue.
+struct bench_control_t {
+    std::atomic<size_t> messages_received;
+    std::atomic<int>    ready;
+    std::atomic<bool>   go;
+    std::atomic<bool>   stop;               // set by the parent to abort the run
+    worker_stats_t      producers[max_producers];
+    worker_stats_t      consumers[max_consumers];
+    latency_histogram   latency[max_consumers];
+};
+
+struct bench_clock_t {
+    bool   tsc         = false;
+    double ns_per_tick = 1.0;
+
+    uint64_t now() const {
+#if defined(__x86_64__) || defined(__i386__)
+        if (tsc) return __rdtsc();
+#endif
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    uint64_t to_ns(uint64_t ticks) const { return static_cast<uint64_t>(ticks * ns_per_tick); }
+
+    // Measures the TSC frequency against steady_clock.
+    void calibrate() {
+        if (!tsc) return;
+        auto t0 = std::chrono::steady_clock::now();
+        auto c0 = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto c1 = now();
+        auto t1 = std::chrono::steady_clock::now();
+        ns_per_tick = std::chrono::duration<double, std::nano>(t1 - t0).count() / (c1 - c0);
+    }
+};
+
+bench_config_t  config;
+bench_clock_t   bench_clock;
+bench_control_t* shared = nullptr;
+
+void pin_to(int slot) {
+    if (config.cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(config.cpus[slot % config.cpus.size()], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+template <typename Queue>
+Queue open_queue(bool create) {
+    if constexpr (requires { Queue::sharded; })
+        return Queue(queue_name, config.lanes, config.capacity, create);
+    else if constexpr (requires { Queue::growable; }) {
+        segment_options_t options;
+        options.handle_slots = max_producers + max_consumers + 1;
+        return Queue(queue_name, config.capacity, config.blocks * Queue::block_bytes(config.capacity), create, options);
+    }
+    else
+        return Queue(queue_name, config.capacity, create);
+}
+
+void wait_for_start(worker_stats_t& stats) {
+    stats.pid = getpid();
+    shared->ready.fetch_add(1);
+    while (!shared->go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+}
+
+uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename Queue, typename Message>
+void producer(int id, size_t count) {
+    pin_to(id);
+    auto q = open_queue<Queue>(false);
+    std::vector<Message> batch(config.batch);
+    uint64_t interval = config.rate > 0 ? static_cast<uint64_t>(1e9 / config.rate / bench_clock.ns_per_tick) : 0;
+    worker_stats_t& stats = shared->producers[id];
+
+    wait_for_start(stats);
+    uint64_t start = steady_ns();
+    uint64_t next  = bench_clock.now();
+    size_t i = 0;
+    while (i < count && !shared->stop.load(std::memory_order_relaxed)) {
+        size_t n = std::min(config.batch, count - i);
+        if (interval) {
+            while (bench_clock.now() < next) cpu_relax();
+        }
+        for (size_t j = 0; j < n; j++) {
+            batch[j].producer = id;
+            batch[j].seq      = static_cast<uint32_t>(i + j);
+            // When paced, stamp the scheduled send time so that queueing delay
+            // caused by a stalled producer still shows up in the histogram.
+            batch[j].sent     = interval ? next : bench_clock.now();
         }
+        for (size_t sent = 0; sent < n; ) {
+            size_t k = n == 1 ? q.enqueue(batch[0]) : q.enqueue_bulk(batch.data() + sent, n - sent);
+            if (k == 0) {
+                if (shared->stop.load(std::memory_order_relaxed)) return;
+                stats.retries++;
+                std::this_thread::yield();
+            }
+            sent += k;
+        }
+        i    += n;
+        next += interval * n;
     }
+    stats.messages   = i;
+    stats.elapsed_ns = steady_ns() - start;
 }
 
-void consumer() {
-    shm_mpmc_bounded_queue<complex_message_t> q("/mpmc_demo_queue", queue_size);
-    complex_message_t out;
-    while (true) {
-        if (q.dequeue(out)) {
-            size_t current = messages_received.fetch_add(1, std::memory_order_relaxed);
-            if (current + 1 >= n_messages) break;
+template <typename Queue, typename Message>
+void consumer(int id) {
+    pin_to(config.producers + id);
+    auto q = open_queue<Queue>(false);
+    std::vector<Message> out(config.batch);
+    latency_histogram& hist  = shared->latency[id];
+    worker_stats_t&    stats = shared->consumers[id];
+
+    wait_for_start(stats);
+    uint64_t start = steady_ns();
+    while (!shared->stop.load(std::memory_order_relaxed)) {
+        size_t k = config.batch == 1 ? q.dequeue(out[0]) : q.dequeue_bulk(out.data(), config.batch);
+        if (k) {
+            uint64_t now = bench_clock.now();
+            for (size_t j = 0; j < k; j++)
+                hist.record(bench_clock.to_ns(now > out[j].sent ? now - out[j].sent : 0));
+            stats.messages += k;
+            size_t current = shared->messages_received.fetch_add(k, std::memory_order_relaxed);
+            if (current + k >= config.messages) break;
         } else {
-            if (messages_received.load(std::memory_order_relaxed) >= n_messages)
+            if (shared->messages_received.load(std::memory_order_relaxed) >= config.messages)
                 break;  // Exit if all messages are already received by others
+            stats.retries++;
             std::this_thread::yield();
         }
     }
+    stats.elapsed_ns = steady_ns() - start;
 }
 
-int main() {
-    shm_unlink("/mpmc_demo_queue");
-    shm_mpmc_bounded_queue<complex_message_t> init("/mpmc_demo_queue", queue_size);
+std::vector<char*> worker_argv;   // our own command line, reused for exec()
+
+// Re-executes this binary as a single worker; it attaches to the queue and
+// the control block by name, like an unrelated process would.
+pid_t spawn_worker(const char* role, int id) {
+    std::string id_str = std::to_string(id);
+    std::vector<char*> argv = worker_argv;
+    argv.push_back(const_cast<char*>("--worker"));
+    argv.push_back(const_cast<char*>(role));
+    argv.push_back(const_cast<char*>("--id"));
+    argv.push_back(id_str.data());
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    if (pid < 0) throw std::runtime_error("fork failed");
+    return pid;
+}
+
+template <typename Queue, typename Message>
+double run() {
+    size_t per_producer = config.messages / config.producers;
+    config.messages     = per_producer * config.producers;
+
+    if (config.worker == "producer") {
+        producer<Queue, Message>(config.worker_id, per_producer);
+        return 0;
+    }
+    if (config.worker == "consumer") {
+        consumer<Queue, Message>(config.worker_id);
+        return 0;
+    }
+
+    shm_unlink(queue_name);
+    auto init = open_queue<Queue>(true);
+
+    std::vector<std::thread> threads;
+    std::vector<pid_t>       children;
+    for (int i = 0; i < config.producers; ++i) {
+        if (config.processes) children.push_back(spawn_worker("producer", i));
+        else                  threads.emplace_back([=] { producer<Queue, Message>(i, per_producer); });
+    }
+    for (int i = 0; i < config.consumers; ++i) {
+        if (config.processes) children.push_back(spawn_worker("consumer", i));
+        else                  threads.emplace_back([=] { consumer<Queue, Message>(i); });
+    }
+
+    // A worker that dies before or during the run would leave the others
+    // waiting forever, so the parent aborts the run as soon as one fails.
+    bool failed = false;
+    auto reap = [&](bool block) {
+        for (auto& pid : children) {
+            int status = 0;
+            if (pid > 0 && waitpid(pid, &status, block ? 0 : WNOHANG) == pid) {
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    failed = true;
+                    shared->stop.store(true);
+                }
+                pid = 0;
+            }
+        }
+    };
+
+    while (shared->ready.load() < config.producers + config.consumers && !failed) {
+        reap(false);
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    shared->go.store(true, std::memory_order_release);
+
+    for (auto& t : threads) t.join();
+    while (std::any_of(children.begin(), children.end(), [](pid_t pid) { return pid > 0; })) {
+        reap(false);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    if (failed) throw std::runtime_error("a worker process failed");
+    return std::chrono::duration<double>(end - start).count();
+}
+
+template <typename Message, typename Layout>
+double run_lanes() {
+    if (config.blocks > 0) return run<shm_growable_queue<Message, Layout>, Message>();
+    if (config.lanes > 1)  return run<shm_sharded_queue<Message, Layout>, Message>();
+    return run<shm_mpmc_bounded_queue<Message, Layout>, Message>();
+}
+
+template <typename Message>
+double run_layout() {
+    if (config.layout == "packed") return run_lanes<Message, packed_cells>();
+    if (config.layout == "split")  return run_lanes<Message, split_cells>();
+    if (config.layout == "padded") return run_lanes<Message, padded_cells>();
+    throw std::invalid_argument("unknown layout: " + config.layout);
+}
+
+double run_payload() {
+    switch (config.payload) {
+    case 16:   return run_layout<bench_message_t<16>>();
+    case 32:   return run_layout<bench_message_t<32>>();
+    case 64:   return run_layout<bench_message_t<64>>();
+    case 128:  return run_layout<bench_message_t<128>>();
+    case 256:  return run_layout<bench_message_t<256>>();
+    case 512:  return run_layout<bench_message_t<512>>();
+    case 1024: return run_layout<bench_message_t<1024>>();
+    }
+    throw std::invalid_argument("payload must be one of 16, 32, 64, 128, 256, 512, 1024");
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [options]\n"
+              << "  --mode threads|processes   run workers as threads (default) or separate processes\n"
+              << "  --producers N              number of producers (default 8)\n"
+              << "  --consumers N              number of consumers (default 8)\n"
+              << "  --messages N               total messages (default 100000000)\n"
+              << "  --payload BYTES            16, 32, 64 (default), 128, 256, 512 or 1024\n"
+              << "  --capacity N               ring capacity, power of 2 (default 1048576)\n"
+              << "  --layout padded|packed|split\n"
+              << "  --lanes K                  use a sharded queue with K lanes of --capacity each\n"
+              << "  --blocks N                 use a growable queue of up to N blocks of --capacity each\n"
+              << "  --batch N                  messages per enqueue_bulk/dequeue_bulk (default 1)\n"
+              << "  --rate R                   target msgs/sec per producer (default unlimited)\n"
+              << "  --pin C0,C1,...            pin producers then consumers to these CPUs\n"
+              << "  --clock steady|tsc         timestamp source (default steady)\n";
+    std::exit(2);
+}
+
+void parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key == "--help" || i + 1 >= argc) usage(argv[0]);
+        std::string val = argv[++i];
+
+        if      (key == "--mode")      config.processes = (val == "processes");
+        else if (key == "--producers") config.producers = std::stoi(val);
+        else if (key == "--consumers") config.consumers = std::stoi(val);
+        else if (key == "--messages")  config.messages  = std::stoull(val);
+        else if (key == "--payload")   config.payload   = std::stoull(val);
+        else if (key == "--capacity")  config.capacity  = std::stoull(val);
+        else if (key == "--layout")    config.layout    = val;
+        else if (key == "--lanes")     config.lanes     = std::max<size_t>(1, std::stoull(val));
+        else if (key == "--blocks")    config.blocks    = std::stoull(val);
+        else if (key == "--batch")     config.batch     = std::max<size_t>(1, std::stoull(val));
+        else if (key == "--rate")      config.rate      = std::stod(val);
+        else if (key == "--clock")     config.tsc       = (val == "tsc");
+        else if (key == "--worker")    config.worker    = val;
+        else if (key == "--id")        config.worker_id = std::stoi(val);
+        else if (key == "--ns-per-tick") {
+            bench_clock.tsc         = config.tsc;
+            bench_clock.ns_per_tick = std::stod(val);
+        }
+        else if (key == "--pin") {
+            for (size_t pos = 0; pos < val.size(); ) {
+                size_t comma = val.find(',', pos);
+                config.cpus.push_back(std::stoi(val.substr(pos, comma - pos)));
+                pos = comma == std::string::npos ? val.size() : comma + 1;
+            }
+        }
+        else usage(argv[0]);
+    }
+    if (config.producers < 1 || config.consumers < 1 ||
+        config.producers > max_producers || config.consumers > max_consumers)
+        usage(argv[0]);
+}
+
+void print_workers(const char* role, const worker_stats_t* stats, int n) {
+    for (int i = 0; i < n; i++) {
+        const auto& s = stats[i];
+        double secs = s.elapsed_ns / 1e9;
+        std::cout << "  " << role << " " << i << " (pid " << s.pid << "): " << s.messages << " msgs, "
+                  << (secs > 0 ? s.messages / secs : 0) << " msgs/sec, " << s.retries << " retries\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    worker_argv.assign(argv, argv + argc);
+
+    if (!config.worker.empty()) {
+        // The parent already calibrated the TSC and passes the result along.
+        shm_segment control(control_name, false, sizeof(bench_control_t));
+        shared = static_cast<bench_control_t*>(control.data());
+        run_payload();
+        return 0;
+    }
 
-    auto start = std::chrono::high_resolution_clock::now();
+    bench_clock.tsc = config.tsc;
+    bench_clock.calibrate();
+    std::string ns_per_tick = std::to_string(bench_clock.ns_per_tick);
+    worker_argv.push_back(const_cast<char*>("--ns-per-tick"));
+    worker_argv.push_back(ns_per_tick.data());
 
-    std::vector<std::thread> producers, consumers;
-    for (int i = 0; i < n_producers; ++i)
-        producers.emplace_back(producer, i, n_messages / n_producers);
-    for (int i = 0; i < n_consumers; ++i)
-        consumers.emplace_back(consumer);
+    shm_unlink(control_name);
+    shm_segment control(control_name, true, sizeof(bench_control_t));
+    shared = new (control.data()) bench_control_t();
 
-    for (auto& p : producers) p.join();
-    for (auto& c : consumers) c.join();
+    double elapsed = run_payload();
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
+    latency_histogram total;
+    for (int i = 0; i < config.consumers; i++) total.merge(shared->latency[i]);
 
-    double latency = elapsed.count() * 1e6 / n_messages; // microseconds per message
-    double throughput = n_messages / elapsed.count();    // messages per second
+    double latency = elapsed * 1e6 / config.messages; // microseconds per message
+    double throughput = config.messages / elapsed;    // messages per second
 
-    std::cout << "Number of producers: " << n_producers << "\n";
-    std::cout << "Number of consumers: " << n_consumers << "\n";
-    std::cout << "Total messages: " << n_messages << "\n";
-    std::cout << "Time elapsed:   " << elapsed.count() << " sec\n";
+    std::cout << "Mode:           " << (config.processes ? "processes" : "threads") << "\n";
+    std::cout << "Number of producers: " << config.producers << "\n";
+    std::cout << "Number of consumers: " << config.consumers << "\n";
+    std::cout << "Payload:        " << config.payload << " bytes, layout " << config.layout
+              << ", capacity " << config.capacity << ", lanes " << config.lanes
+              << ", blocks " << config.blocks
+              << ", batch " << config.batch << "\n";
+    std::cout << "Total messages: " << config.messages << "\n";
+    std::cout << "Time elapsed:   " << elapsed << " sec\n";
     std::cout << "Throughput:     " << throughput << " msgs/sec\n";
     std::cout << "Average time per logical message: " << latency << " us/msg\n";
+    std::cout << "Latency (ns):   p50=" << total.percentile(0.50)
+              << " p90=" << total.percentile(0.90)
+              << " p99=" << total.percentile(0.99)
+              << " p99.9=" << total.percentile(0.999)
+              << " max=" << total.max()
+              << " mean=" << total.mean() << "\n";
+    std::cout << "Per worker:\n";
+    print_workers("producer", shared->producers, config.producers);
+    print_workers("consumer", shared->consumers, config.consumers);
 
     return 0;
 }
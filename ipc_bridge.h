@@ -0,0 +1,312 @@
+// Bridges a queue to another host over TCP: a sender drains a local queue
+// in batches and writes them to a socket, and a receiver on the other end
+// enqueues them into a queue there with the matching bulk call.
+//
+//     // host A: /orders -> B                    // host B: socket -> /orders
+//     shm_tcp_sender<queue_t, order_t> tx(q, fd);   shm_tcp_receiver<queue_t, order_t> rx(q, fd);
+//     tx.run(stop);                                 rx.run(stop);
+//
+// The sender takes the socket once it is connected and the receiver once it
+// is accepted; connecting, reconnecting and listening are up to the caller
+// (see shm_bridge.cpp). Both work with the queue types that have
+// dequeue_bulk()/enqueue_bulk() and dequeue_wait()/enqueue_wait() without
+// extra arguments: the bounded, sharded, growable and directory queues.
+//
+// On the wire, a connection starts with a bridge_hello_t, then carries
+// frames: a bridge_frame_t followed by `count` payloads as they are laid out
+// in memory, sent with one writev() from the batch buffer. Payloads are
+// copied byte by byte, so both ends must use the same Payload on the same
+// architecture; the hello checks size, alignment and byte order.
+//
+// Batching adapts to the load. A frame is sent once it holds max_batch
+// messages, or once the queue is empty and the oldest message in the batch
+// has waited max_delay. Under load the batch fills while the previous
+// writev() is in flight; when idle, a message leaves after max_delay.
+//
+// Every message gets a sequence number. A sender carries on from
+// bridge_options_t::first_seq, so a bridge that reconnects can continue the
+// numbering. A receiver counts the messages missing between the frames it
+// got as lost, e.g. a batch that was dequeued but never written out.
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::uint32_t bridge_magic   = 0x47445242;     // "BRDG"
+constexpr std::uint32_t bridge_version = 1;
+constexpr std::size_t   bridge_max_batch = 65536;       // receivers refuse larger frames
+
+}
+
+struct bridge_options_t {
+    std::size_t              max_batch = 256;                              // messages per frame
+    std::chrono::nanoseconds max_delay = std::chrono::microseconds(20);    // oldest message waits at most this long
+    std::uint64_t            first_seq = 0;                                // sender: number of the first message
+    std::chrono::nanoseconds idle_wait = std::chrono::milliseconds(1);     // blocking wait per step of run()
+};
+
+struct bridge_stats_t {
+    std::uint64_t messages = 0;
+    std::uint64_t frames   = 0;
+    std::uint64_t bytes    = 0;
+    std::uint64_t gaps     = 0;     // receiver: frames that did not continue the sequence
+    std::uint64_t lost     = 0;     // receiver: messages skipped by those gaps
+};
+
+// First thing on a connection, sent by the sender.
+struct bridge_hello_t {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t payload_size;
+    std::uint64_t payload_align;
+    std::uint64_t max_batch;
+};
+
+struct bridge_frame_t {
+    std::uint32_t magic;
+    std::uint32_t count;
+    std::uint64_t first_seq;
+};
+
+namespace {
+
+// Writes all of `iov`, advancing it past partial writes.
+inline void bridge_writev(int fd, iovec* iov, int n) {
+    while (n > 0) {
+        auto w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "bridge write failed");
+        }
+        auto done = static_cast<std::size_t>(w);
+        while (n > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+// Reads exactly `len` bytes. Returns false on a clean EOF before the first byte.
+inline bool bridge_read(int fd, void* buf, std::size_t len) {
+    auto* p = static_cast<char*>(buf);
+    for (std::size_t got = 0; got < len;) {
+        auto r = read(fd, p + got, len - got);
+        if (r == 0) {
+            if (got == 0) return false;
+            throw std::runtime_error("bridge connection closed in the middle of a frame");
+        }
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "bridge read failed");
+        }
+        got += static_cast<std::size_t>(r);
+    }
+    return true;
+}
+
+}
+
+template <typename Queue, typename Payload>
+class shm_tcp_sender {
+    static_assert(std::is_trivially_copyable_v<Payload>, "bridged payloads are sent byte by byte");
+
+public:
+    // Takes over `fd`, a connected stream socket, and sends the hello.
+    shm_tcp_sender(Queue& q, int fd, const bridge_options_t& options = {})
+        : q_(q), fd_(fd), options_(options), next_seq_(options.first_seq)
+    {
+        if (options.max_batch == 0 || options.max_batch > bridge_max_batch) {
+            close(fd_);
+            throw std::invalid_argument("max_batch must be between 1 and " + std::to_string(bridge_max_batch));
+        }
+        batch_.resize(options.max_batch);
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // batching is done here
+
+        bridge_hello_t hello { bridge_magic, bridge_version, sizeof(Payload), alignof(Payload), options.max_batch };
+        iovec iov { &hello, sizeof(hello) };
+        try {
+            bridge_writev(fd_, &iov, 1);
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+    }
+
+    ~shm_tcp_sender() { close(fd_); }
+
+    const bridge_stats_t& stats() const { return stats_; }
+
+    // Number the next message will get.
+    std::uint64_t next_seq() const { return next_seq_; }
+
+    // Messages dequeued but not sent yet.
+    std::size_t pending() const { return count_; }
+
+    // Moves what the queue has into the batch and sends the batch if it is
+    // due. Returns the number of messages dequeued.
+    std::size_t poll() {
+        auto n = q_.dequeue_bulk(batch_.data() + count_, options_.max_batch - count_);
+        if (n && count_ == 0) oldest_ = std::chrono::steady_clock::now();
+        count_ += n;
+        if (count_ == options_.max_batch ||
+            (count_ && n == 0 && std::chrono::steady_clock::now() - oldest_ >= options_.max_delay))
+            flush();
+        return n;
+    }
+
+    // Sends the batch now, if there is one.
+    void flush() {
+        if (count_ == 0) return;
+        bridge_frame_t frame { bridge_magic, static_cast<std::uint32_t>(count_), next_seq_ };
+        iovec iov[2] = { { &frame, sizeof(frame) }, { batch_.data(), count_ * sizeof(Payload) } };
+
+        // The messages are gone from the queue either way; if the write
+        // fails they are skipped in the numbering and show up as lost.
+        next_seq_ += count_;
+        auto n  = count_;
+        count_  = 0;
+        bridge_writev(fd_, iov, 2);
+        stats_.messages += n;
+        stats_.frames++;
+        stats_.bytes += sizeof(frame) + n * sizeof(Payload);
+    }
+
+    // Bridges until `stop` is set, then sends what is left. Sleeps on the
+    // queue while it is empty and nothing is pending.
+    void run(const std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (poll() || count_) continue;
+            if (q_.dequeue_wait(batch_[0], options_.idle_wait)) {
+                oldest_ = std::chrono::steady_clock::now();
+                count_  = 1;
+            }
+        }
+        flush();
+    }
+
+private:
+    Queue&                                q_;
+    int                                   fd_;
+    bridge_options_t                      options_;
+    std::uint64_t                         next_seq_;
+    std::vector<Payload>                  batch_;
+    std::size_t                           count_ = 0;
+    std::chrono::steady_clock::time_point oldest_;
+    bridge_stats_t                        stats_;
+
+    shm_tcp_sender(shm_tcp_sender const&) = delete;
+    void operator=(shm_tcp_sender const&) = delete;
+};
+
+template <typename Queue, typename Payload>
+class shm_tcp_receiver {
+    static_assert(std::is_trivially_copyable_v<Payload>, "bridged payloads are sent byte by byte");
+
+public:
+    static constexpr std::uint64_t any_seq = UINT64_MAX;
+
+    // Takes over `fd`, an accepted stream socket, and checks the hello.
+    // `expected_seq` is the number the first message should have, e.g. the
+    // expected_seq() of the receiver of a previous connection; any_seq
+    // accepts whatever the sender starts with.
+    shm_tcp_receiver(Queue& q, int fd, std::uint64_t expected_seq = any_seq)
+        : q_(q), fd_(fd), expected_(expected_seq)
+    {
+        bridge_hello_t hello {};
+        if (!bridge_read(fd_, &hello, sizeof(hello)))
+            fail("bridge connection closed before the hello");
+        if (hello.magic != bridge_magic)
+            fail("not a bridge connection, or the sender has a different byte order");
+        if (hello.version != bridge_version)
+            fail("bridge version " + std::to_string(hello.version) + ", this build uses version " +
+                 std::to_string(bridge_version));
+        if (hello.payload_size != sizeof(Payload) || hello.payload_align != alignof(Payload))
+            fail("payload mismatch, sender has " + std::to_string(hello.payload_size) + " bytes aligned to " +
+                 std::to_string(hello.payload_align) + ", this receiver expects " + std::to_string(sizeof(Payload)) +
+                 " aligned to " + std::to_string(alignof(Payload)));
+        if (hello.max_batch == 0 || hello.max_batch > bridge_max_batch)
+            fail("sender announced a batch of " + std::to_string(hello.max_batch) + " messages");
+        max_batch_ = hello.max_batch;
+        batch_.resize(max_batch_);
+    }
+
+    ~shm_tcp_receiver() { close(fd_); }
+
+    const bridge_stats_t& stats() const { return stats_; }
+
+    // Number the next message should have.
+    std::uint64_t expected_seq() const { return expected_; }
+
+    // Reads one frame and enqueues all of it, waiting for room in the queue
+    // (which pushes back on the sender through TCP flow control). Returns
+    // false once the sender has closed the connection.
+    bool poll() {
+        bridge_frame_t frame;
+        if (!bridge_read(fd_, &frame, sizeof(frame))) return false;
+        if (frame.magic != bridge_magic || frame.count == 0 || frame.count > max_batch_)
+            throw std::runtime_error("corrupt bridge frame");
+        if (!bridge_read(fd_, batch_.data(), frame.count * sizeof(Payload)))
+            throw std::runtime_error("bridge connection closed in the middle of a frame");
+
+        if (expected_ != any_seq && frame.first_seq != expected_) {
+            stats_.gaps++;
+            if (frame.first_seq > expected_) stats_.lost += frame.first_seq - expected_;
+        }
+        expected_ = frame.first_seq + frame.count;
+
+        for (std::size_t done = 0; done < frame.count;) {
+            auto k = q_.enqueue_bulk(batch_.data() + done, frame.count - done);
+            if (k == 0 && q_.enqueue_wait(batch_[done], std::chrono::milliseconds(100))) k = 1;
+            done += k;
+        }
+        stats_.messages += frame.count;
+        stats_.frames++;
+        stats_.bytes += sizeof(frame) + frame.count * sizeof(Payload);
+        return true;
+    }
+
+    // Receives until the sender disconnects or `stop` is set; `stop` is
+    // checked between frames.
+    void run(const std::atomic<bool>& stop) {
+        while (!stop.load(std::memory_order_relaxed) && poll()) {}
+    }
+
+private:
+    Queue&               q_;
+    int                  fd_;
+    std::uint64_t        expected_;
+    std::uint64_t        max_batch_ = 0;
+    std::vector<Payload> batch_;
+    bridge_stats_t       stats_;
+
+    shm_tcp_receiver(shm_tcp_receiver const&) = delete;
+    void operator=(shm_tcp_receiver const&) = delete;
+
+    [[noreturn]] void fail(const std::string& what) {
+        close(fd_);
+        throw std::runtime_error(what);
+    }
+};
@@ -0,0 +1,366 @@
+// Broadcast (pub/sub) ring over shared memory: every subscriber sees every
+// message, and a message is written once no matter how many subscribers read it.
+//
+// Publishers claim positions from a single write cursor; each subscriber owns
+// a read cursor in the segment's subscriber table. Cell `pos & mask` carries a
+// seqlock-style sequence word:
+//
+//   seq == 2 * pos + 1   the message for `pos` is being written
+//   seq == 2 * pos + 2   the message for `pos` is published
+//
+// A publisher takes a cell over only from the exact value the previous lap
+// left in it, so a stalled publisher can never land on top of a newer lap.
+//
+// In gating mode publishers never overwrite a cell that an active subscriber
+// has not read yet, so the slowest subscriber throttles them. In lossy mode
+// publishers never wait for subscribers; a subscriber that falls a whole ring behind notices
+// that its cell was overwritten, skips forward and counts what it missed.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include "ipc_shm.h"
+
+namespace {
+
+constexpr std::size_t   default_broadcast_size        = 65536;   // must be a power of 2
+constexpr std::uint32_t default_broadcast_subscribers = 32;
+constexpr std::size_t   broadcast_layout_id           = 0x200;
+
+constexpr std::uint32_t subscriber_free    = 0;
+constexpr std::uint32_t subscriber_joining = 1;
+constexpr std::uint32_t subscriber_active  = 2;
+
+}
+
+enum class broadcast_policy_t : std::uint32_t {
+    gating = 0,     // publishers wait for the slowest subscriber
+    lossy  = 1,     // publishers overwrite, lagging subscribers skip ahead
+};
+
+// One line per subscriber, so cursors of different subscribers never share one.
+struct alignas(std::hardware_destructive_interference_size) broadcast_subscriber_t {
+    std::atomic<std::uint64_t> cursor;          // next position this subscriber reads
+    std::atomic<std::uint32_t> state;
+    std::atomic<std::int32_t>  pid;
+    std::atomic<std::uint64_t> start_time;      // see process_start_time()
+    std::atomic<std::uint64_t> missed;          // messages overwritten before they were read
+};
+
+// Control block at the start of a broadcast segment; the subscriber table and
+// then the cells follow it.
+struct broadcast_data_t {
+    segment_header_t   header;
+    std::size_t        mask;
+    broadcast_policy_t policy;
+    std::uint32_t      max_subscribers;
+
+    alignas(std::hardware_destructive_interference_size)
+    std::atomic<std::uint64_t> claim_pos;       // next position a publisher claims
+
+    // Futex words, see queue_data_t.
+    alignas(std::hardware_destructive_interference_size)
+    std::atomic<std::uint32_t> published;
+    std::atomic<std::uint32_t> subscribers_waiting;
+    std::atomic<std::uint32_t> space;
+    std::atomic<std::uint32_t> publishers_waiting;
+
+    broadcast_subscriber_t* subscribers() {
+        return reinterpret_cast<broadcast_subscriber_t*>(reinterpret_cast<char*>(this) + sizeof(broadcast_data_t));
+    }
+
+    char* cells() {
+        return reinterpret_cast<char*>(subscribers() + max_subscribers);
+    }
+};
+
+template <typename Payload>
+struct alignas(std::hardware_destructive_interference_size) broadcast_cell_t {
+    std::atomic<std::uint64_t> seq;
+    Payload data;
+};
+
+template <typename Payload>
+class shm_broadcast_ring {
+    static_assert(std::is_trivially_copyable_v<Payload>,
+                  "subscribers copy payloads that may be overwritten concurrently");
+
+    using cell_t = broadcast_cell_t<Payload>;
+
+public:
+    // `capacity`, `policy` and `max_subscribers` are only used by the creator.
+    explicit shm_broadcast_ring(const std::string& shm_name,
+                                std::size_t capacity = default_broadcast_size,
+                                broadcast_policy_t policy = broadcast_policy_t::gating,
+                                std::uint32_t max_subscribers = default_broadcast_subscribers,
+                                bool create_segment = true,
+                                const segment_options_t& options = {})
+        : segment_(shm_name, create_segment, checked_segment_size(capacity, max_subscribers), options),
+          data_(static_cast<broadcast_data_t*>(segment_.data()))
+    {
+        if (segment_.created()) {
+            init(capacity, policy, max_subscribers);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, broadcast_layout_id, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, sizeof(cell_t), "cell size");
+            if (segment_size(h.capacity, data_->max_subscribers) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        cells_    = reinterpret_cast<cell_t*>(data_->cells());
+        capacity_ = data_->header.capacity;
+        lossy_    = data_->policy == broadcast_policy_t::lossy;
+    }
+
+    std::size_t        capacity() const { return capacity_; }
+    broadcast_policy_t policy()   const { return data_->policy; }
+
+    static std::size_t segment_size(std::size_t capacity, std::uint32_t max_subscribers) {
+        return sizeof(broadcast_data_t) + max_subscribers * sizeof(broadcast_subscriber_t) +
+               capacity * sizeof(cell_t);
+    }
+
+    // A subscriber slot. Reads start at the first message published after
+    // subscribe() returned; dropping the handle frees the slot.
+    class subscription {
+    public:
+        subscription() = default;
+        subscription(subscription&& o) noexcept { *this = std::move(o); }
+        subscription& operator=(subscription&& o) noexcept {
+            if (this != &o) {
+                unsubscribe();
+                ring_ = o.ring_; slot_ = o.slot_; pos_ = o.pos_;
+                o.slot_ = nullptr;
+            }
+            return *this;
+        }
+        ~subscription() { unsubscribe(); }
+
+        explicit operator bool() const { return slot_ != nullptr; }
+
+        // Copies the next message into `out`. Returns false if nothing new
+        // has been published yet.
+        bool try_receive(Payload& out) {
+            auto* q = ring_->data_;
+            for (;;) {
+                auto& c      = ring_->cell_at(pos_);
+                auto  expect = 2 * pos_ + 2;
+                auto  seq    = c.seq.load(std::memory_order_acquire);
+
+                if (seq < expect) return false;                 // not published yet
+                if (seq == expect) {
+                    out = c.data;
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (c.seq.load(std::memory_order_relaxed) == expect) {
+                        slot_->cursor.store(++pos_, std::memory_order_release);
+                        if (!ring_->lossy_)
+                            notify_waiters(q->space, q->publishers_waiting, INT_MAX);
+                        return true;
+                    }
+                }
+                // Overwritten by a later lap: resume at the oldest message
+                // that can still be in the ring.
+                auto head   = q->claim_pos.load(std::memory_order_acquire);
+                auto oldest = head > ring_->capacity_ ? head - ring_->capacity_ : 0;
+                if (oldest <= pos_) oldest = pos_ + 1;
+                slot_->missed.fetch_add(oldest - pos_, std::memory_order_relaxed);
+                pos_ = oldest;
+                slot_->cursor.store(pos_, std::memory_order_release);
+            }
+        }
+
+        // Blocking variant: spin, then sleep until something is published or
+        // `timeout` expires. Returns false on timeout.
+        bool receive_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout) {
+            auto* q = ring_->data_;
+            return waiter_.wait_until([&] { return try_receive(out); },
+                                      q->published, q->subscribers_waiting, timeout);
+        }
+
+        // Messages this subscriber lost to being lapped (lossy mode only).
+        std::uint64_t missed() const { return slot_->missed.load(std::memory_order_relaxed); }
+
+        void unsubscribe() {
+            if (!slot_) return;
+            slot_->state.store(subscriber_free, std::memory_order_release);
+            notify_waiters(ring_->data_->space, ring_->data_->publishers_waiting, INT_MAX);
+            slot_ = nullptr;
+        }
+
+    private:
+        friend class shm_broadcast_ring;
+        subscription(shm_broadcast_ring* ring, broadcast_subscriber_t* slot, std::uint64_t pos)
+            : ring_(ring), slot_(slot), pos_(pos) {}
+
+        shm_broadcast_ring*     ring_ = nullptr;
+        broadcast_subscriber_t* slot_ = nullptr;
+        std::uint64_t           pos_  = 0;
+        adaptive_waiter         waiter_;
+    };
+
+    // Takes a free subscriber slot. Throws if all slots are in use.
+    subscription subscribe() {
+        auto* q = data_;
+        for (std::uint32_t i = 0; i < q->max_subscribers; i++) {
+            auto& s        = q->subscribers()[i];
+            auto  expected = subscriber_free;
+            if (!s.state.compare_exchange_strong(expected, subscriber_joining, std::memory_order_acquire))
+                continue;
+
+            auto pid = static_cast<std::int32_t>(getpid());
+            s.pid.store(pid, std::memory_order_relaxed);
+            s.start_time.store(process_start_time(pid), std::memory_order_relaxed);
+            s.missed.store(0, std::memory_order_relaxed);
+            s.cursor.store(q->claim_pos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            s.state.store(subscriber_active, std::memory_order_seq_cst);
+
+            // Publishers that gated before they saw us active only claimed
+            // positions up to this one, so nothing from here on is overwritten.
+            auto pos = q->claim_pos.load(std::memory_order_seq_cst);
+            s.cursor.store(pos, std::memory_order_release);
+            return subscription(this, &s, pos);
+        }
+        throw std::runtime_error("no free subscriber slot");
+    }
+
+    // Publishes `v` to every subscriber. Returns false if, in gating mode,
+    // the slowest subscriber is a whole ring behind.
+    bool publish(const Payload& v) {
+        auto* q   = data_;
+        auto  pos = q->claim_pos.load(std::memory_order_relaxed);
+
+        for (;;) {
+            if (!lossy_ && pos - gate_ >= capacity_) {
+                gate_ = min_cursor(pos);
+                if (pos - gate_ >= capacity_) {
+                    auto now = q->claim_pos.load(std::memory_order_relaxed);
+                    if (now == pos) return false;              // full
+                    pos = now;
+                    continue;
+                }
+            }
+            if (q->claim_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+
+        auto& c = cell_at(pos);
+        // The publisher of the previous lap may still be copying into this
+        // cell, or may not even have started yet; wait until it has published.
+        auto prev = pos >= capacity_ ? 2 * (pos - capacity_) + 2 : 0;
+        for (unsigned spins = 0;; spins++) {
+            auto seq = prev;
+            if (c.seq.compare_exchange_weak(seq, 2 * pos + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+            if (spins < 64) cpu_relax();
+            else            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        c.data = v;
+        c.seq.store(2 * pos + 2, std::memory_order_release);
+        notify_waiters(q->published, q->subscribers_waiting, INT_MAX);
+        return true;
+    }
+
+    bool publish_wait(const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        return waiter_.wait_until([&] { return publish(v); },
+                                  data_->space, data_->publishers_waiting, timeout);
+    }
+
+    std::uint32_t subscriber_count() const {
+        std::uint32_t n = 0;
+        for (std::uint32_t i = 0; i < data_->max_subscribers; i++)
+            n += data_->subscribers()[i].state.load(std::memory_order_relaxed) == subscriber_active;
+        return n;
+    }
+
+    // Frees the slots of subscribers whose process has exited, so that a
+    // crashed subscriber does not gate publishers forever. Returns how many
+    // slots were freed.
+    std::uint32_t reap_subscribers() {
+        std::uint32_t n = 0;
+        for (std::uint32_t i = 0; i < data_->max_subscribers; i++) {
+            auto& s   = data_->subscribers()[i];
+            auto  pid = s.pid.load(std::memory_order_relaxed);
+            if (s.state.load(std::memory_order_acquire) == subscriber_active &&
+                !process_alive(pid, s.start_time.load(std::memory_order_relaxed))) {
+                auto expected = subscriber_active;
+                n += s.state.compare_exchange_strong(expected, subscriber_free);
+            }
+        }
+        if (n) notify_waiters(data_->space, data_->publishers_waiting, INT_MAX);
+        return n;
+    }
+
+private:
+    shm_broadcast_ring(shm_broadcast_ring const&) = delete;
+    void operator=(shm_broadcast_ring const&) = delete;
+
+    shm_segment       segment_;
+    broadcast_data_t* data_;
+    cell_t*           cells_    = nullptr;
+    std::size_t       capacity_ = 0;
+    bool              lossy_    = false;
+    std::uint64_t     gate_     = 0;    // cached lower bound of all subscriber cursors
+    adaptive_waiter   waiter_;
+
+    cell_t& cell_at(std::uint64_t pos) { return cells_[pos & data_->mask]; }
+
+    // Oldest position any active subscriber still has to read, or `pos` if
+    // there are no subscribers. Pairs with the seq_cst store in subscribe().
+    std::uint64_t min_cursor(std::uint64_t pos) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto lowest = pos;
+        for (std::uint32_t i = 0; i < data_->max_subscribers; i++) {
+            auto& s = data_->subscribers()[i];
+            if (s.state.load(std::memory_order_acquire) != subscriber_active) continue;
+            lowest = std::min<std::uint64_t>(lowest, s.cursor.load(std::memory_order_acquire));
+        }
+        return lowest;
+    }
+
+    void init(std::size_t capacity, broadcast_policy_t policy, std::uint32_t max_subscribers) {
+        auto* q = data_;
+        q->header.capacity      = capacity;
+        q->header.cell_size     = sizeof(cell_t);
+        q->header.payload_size  = sizeof(Payload);
+        q->header.payload_align = alignof(Payload);
+        q->header.layout        = broadcast_layout_id;
+        q->mask            = capacity - 1;
+        q->policy          = policy;
+        q->max_subscribers = max_subscribers;
+        q->claim_pos.store(0, std::memory_order_relaxed);
+        q->published.store(0, std::memory_order_relaxed);
+        q->subscribers_waiting.store(0, std::memory_order_relaxed);
+        q->space.store(0, std::memory_order_relaxed);
+        q->publishers_waiting.store(0, std::memory_order_relaxed);
+
+        for (std::uint32_t i = 0; i < max_subscribers; i++)
+            new (&q->subscribers()[i]) broadcast_subscriber_t{};
+        // seq 0 reads as "not published" for every position
+        auto* cells = reinterpret_cast<cell_t*>(q->cells());
+        for (std::size_t i = 0; i < capacity; i++)
+            cells[i].seq.store(0, std::memory_order_relaxed);
+    }
+
+    static std::size_t checked_segment_size(std::size_t capacity, std::uint32_t max_subscribers) {
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("capacity must be a power of 2");
+        if (max_subscribers == 0)
+            throw std::invalid_argument("max_subscribers must be at least 1");
+        return segment_size(capacity, max_subscribers);
+    }
+};
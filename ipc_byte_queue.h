@@ -0,0 +1,269 @@
+// Variable-length MPMC queue over a shared byte ring.
+//
+// Producers reserve a length-prefixed record in the ring, write it in place
+// and commit it; consumers read the record where it lies and release it.
+// Every record starts with a 16-byte header whose tag encodes the absolute
+// ring position the record was written at plus its state, so stale headers
+// from earlier laps never look valid and nothing has to be cleared:
+//
+//   tag == pos | record_committed   record is readable
+//   tag == pos | record_consumed    record is read, its space can be reused
+//
+// Since a header can land anywhere a payload used to be on an earlier lap,
+// consumers scrub the header-aligned words of a record before releasing it,
+// so old payload bytes can never be mistaken for a committed tag.
+//
+// A record never wraps; when it does not fit before the end of the ring the
+// producer fills the tail with a padding record that consumers skip.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include "ipc_shm.h"
+
+struct byte_record_header_t {
+    std::atomic<std::uint64_t> tag;
+    std::uint32_t              len;
+    std::uint32_t              flags;
+};
+
+namespace {
+
+constexpr std::size_t default_byte_queue_size = 1 << 20; // bytes, must be a power of 2
+
+constexpr std::size_t   record_align     = sizeof(byte_record_header_t);
+constexpr std::uint64_t record_committed = 1;
+constexpr std::uint64_t record_consumed  = 2;
+constexpr std::uint32_t record_padding   = 1;
+
+inline std::size_t record_size(std::size_t len) {
+    return (sizeof(byte_record_header_t) + len + record_align - 1) & ~(record_align - 1);
+}
+
+}
+
+struct byte_queue_data_t {
+    segment_header_t header;
+    std::size_t mask;
+
+    alignas(std::hardware_destructive_interference_size)
+    std::atomic<std::uint64_t> write_pos;       // next byte producers reserve
+
+    alignas(std::hardware_destructive_interference_size)
+    std::atomic<std::uint64_t> read_pos;        // next record consumers claim
+
+    alignas(std::hardware_destructive_interference_size)
+    std::atomic<std::uint64_t> release_pos;     // everything before this is free
+
+    // header.capacity bytes of ring follow right after this struct
+    char* ring() {
+        return reinterpret_cast<char*>(this) + sizeof(byte_queue_data_t);
+    }
+
+    byte_record_header_t* record_at(std::uint64_t pos) {
+        return reinterpret_cast<byte_record_header_t*>(ring() + (pos & mask));
+    }
+
+    static std::size_t segment_size(std::size_t capacity) {
+        return sizeof(byte_queue_data_t) + capacity;
+    }
+};
+
+inline void init_byte_queue(byte_queue_data_t* q, std::size_t capacity) {
+    q->header.capacity      = capacity;
+    q->header.cell_size     = record_align;
+    q->header.payload_size  = 0;
+    q->header.payload_align = 0;
+    q->header.layout        = 0;
+    q->mask = capacity - 1;
+    q->write_pos.store(0, std::memory_order_relaxed);
+    q->read_pos.store(0, std::memory_order_relaxed);
+    q->release_pos.store(0, std::memory_order_relaxed);
+}
+
+class shm_mpmc_byte_queue {
+public:
+    // A reserved or claimed record. `data` points straight into the ring.
+    struct record {
+        char*         data = nullptr;
+        std::size_t   size = 0;
+        std::uint64_t pos  = 0;
+
+        explicit operator bool() const { return data != nullptr; }
+    };
+
+    // `capacity` is the ring size in bytes and is only used by the creator.
+    explicit shm_mpmc_byte_queue(const std::string& shm_name,
+                                 std::size_t capacity = default_byte_queue_size,
+                                 bool create_segment = true,
+                                 const segment_options_t& options = {})
+        : segment_(shm_name, create_segment, checked_segment_size(capacity), options),
+          data_(static_cast<byte_queue_data_t*>(segment_.data()))
+    {
+        if (segment_.created()) {
+            init_byte_queue(data_, capacity);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, 0, "cell layout");
+            segment_.check_field(h.payload_size, 0, "payload size");
+            segment_.check_field(h.cell_size, record_align, "record alignment");
+            if (byte_queue_data_t::segment_size(h.capacity) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+    }
+
+    std::size_t capacity() const { return data_->mask + 1; }
+
+    // Largest payload a single record can carry.
+    std::size_t max_message_size() const {
+        return capacity() / 2 - sizeof(byte_record_header_t);
+    }
+
+    // Reserves `len` writable bytes in the ring. Returns an empty record if
+    // there is not enough free space right now.
+    record try_reserve(std::size_t len) {
+        auto* q    = data_;
+        auto  need = record_size(len);
+        auto  pos  = q->write_pos.load(std::memory_order_relaxed);
+
+        if (len > max_message_size())
+            throw std::invalid_argument("message larger than half the ring");
+
+        for (;;) {
+            auto tail  = capacity() - (pos & q->mask);
+            auto total = need <= tail ? need : tail + need;    // pad to the end, then wrap
+
+            if (pos + total - q->release_pos.load(std::memory_order_acquire) > capacity()) {
+                reclaim();
+                if (pos + total - q->release_pos.load(std::memory_order_acquire) > capacity()) {
+                    auto now = q->write_pos.load(std::memory_order_relaxed);
+                    if (now == pos) return {};                  // full
+                    pos = now;
+                    continue;
+                }
+            }
+            if (q->write_pos.compare_exchange_weak(pos, pos + total, std::memory_order_relaxed)) {
+                if (total != need) {
+                    auto* pad  = q->record_at(pos);
+                    pad->len   = static_cast<std::uint32_t>(tail - sizeof(byte_record_header_t));
+                    pad->flags = record_padding;
+                    pad->tag.store(pos | record_committed, std::memory_order_release);
+                    pos += tail;
+                }
+                return { q->ring() + (pos & q->mask) + sizeof(byte_record_header_t), len, pos };
+            }
+        }
+    }
+
+    // Publishes a record obtained from try_reserve().
+    void commit(const record& r) {
+        auto* h  = data_->record_at(r.pos);
+        h->len   = static_cast<std::uint32_t>(r.size);
+        h->flags = 0;
+        h->tag.store(r.pos | record_committed, std::memory_order_release);
+    }
+
+    // Claims the oldest committed record. Returns an empty record if the
+    // queue is empty or the oldest record is not committed yet.
+    record try_read() {
+        auto* q   = data_;
+        auto  pos = q->read_pos.load(std::memory_order_relaxed);
+
+        for (;;) {
+            auto* h   = q->record_at(pos);
+            auto  tag = h->tag.load(std::memory_order_acquire);
+
+            if (tag != (pos | record_committed)) {
+                auto now = q->read_pos.load(std::memory_order_relaxed);
+                if (now == pos) return {};                      // empty
+                pos = now;
+                continue;
+            }
+            auto len   = h->len;
+            auto flags = h->flags;
+            if (q->read_pos.compare_exchange_weak(pos, pos + record_size(len), std::memory_order_relaxed)) {
+                if (flags & record_padding) {
+                    scrub(pos, len);
+                    h->tag.store(pos | record_consumed, std::memory_order_release);
+                    pos += record_size(len);
+                    continue;
+                }
+                return { reinterpret_cast<char*>(h) + sizeof(byte_record_header_t), len, pos };
+            }
+        }
+    }
+
+    // Hands a record obtained from try_read() back to the producers.
+    void release(const record& r) {
+        scrub(r.pos, r.size);
+        data_->record_at(r.pos)->tag.store(r.pos | record_consumed, std::memory_order_release);
+        reclaim();
+    }
+
+    // Copying conveniences on top of the in-place API.
+    bool enqueue(const void* p, std::size_t len) {
+        auto r = try_reserve(len);
+        if (!r) return false;
+        std::memcpy(r.data, p, len);
+        commit(r);
+        return true;
+    }
+
+    // Copies the next message into `out` (at most `cap` bytes) and returns its
+    // length, or -1 if the queue is empty.
+    std::ptrdiff_t dequeue(void* out, std::size_t cap) {
+        auto r = try_read();
+        if (!r) return -1;
+        std::memcpy(out, r.data, std::min(cap, r.size));
+        release(r);
+        return static_cast<std::ptrdiff_t>(r.size);
+    }
+
+private:
+    shm_segment         segment_;
+    byte_queue_data_t*  data_;
+
+    shm_mpmc_byte_queue(shm_mpmc_byte_queue const&) = delete;
+    void operator=(shm_mpmc_byte_queue const&) = delete;
+
+    // Zeroes every header-aligned word inside the record's payload.
+    void scrub(std::uint64_t pos, std::size_t len) {
+        auto* base = reinterpret_cast<char*>(data_->record_at(pos));
+        auto  size = record_size(len);
+        for (std::size_t off = record_align; off < size; off += record_align)
+            std::memset(base + off, 0, sizeof(std::uint64_t));
+    }
+
+    // Moves release_pos over every record consumed so far, in ring order.
+    // Consumers can finish out of order; whoever releases the oldest one
+    // (or a producer short on space) advances past the whole run.
+    void reclaim() {
+        auto* q = data_;
+        auto  r = q->release_pos.load(std::memory_order_acquire);
+
+        while (r != q->read_pos.load(std::memory_order_acquire)) {
+            auto* h = q->record_at(r);
+            if (h->tag.load(std::memory_order_acquire) != (r | record_consumed))
+                return;
+            auto len = h->len;
+            if (!q->release_pos.compare_exchange_weak(r, r + record_size(len), std::memory_order_release,
+                                                      std::memory_order_acquire))
+                continue;
+            r += record_size(len);
+        }
+    }
+
+    static std::size_t checked_segment_size(std::size_t capacity) {
+        if (capacity < 4 * record_align || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("capacity must be a power of 2 of at least 64 bytes");
+        return byte_queue_data_t::segment_size(capacity);
+    }
+};
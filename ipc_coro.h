@@ -0,0 +1,320 @@
+// C++20 coroutine front end for the queues: a consumer or producer is a
+// queue_task that does `co_await async_dequeue(q)` / `co_await
+// async_enqueue(q, msg)`, and one queue_executor thread runs any number of
+// them. A task that finds its queue empty (or full) is parked instead of
+// holding an OS thread, and is resumed once the operation has completed.
+//
+// As long as a queue has messages, co_await completes without suspending,
+// for up to `batch` operations per resumption, so a busy consumer drains its
+// queue at close to the cost of a plain dequeue() before it lets the other
+// tasks run.
+//
+// When everything is parked the executor spins briefly, then sleeps in
+// epoll_wait. Dequeuers of an shm_mpmc_bounded_queue created with
+// listener_slots are woken through the queue's notification fd, see
+// notify_fd(); everything else (full queues, the other queue types) is
+// polled at least every `max_idle`.
+//
+// Queues and the executor are not thread-safe: every handle awaited by tasks
+// of an executor belongs to that executor's thread and must outlive run().
+
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "ipc_shm.h"
+
+class queue_executor;
+
+// Fire-and-forget coroutine, started by queue_executor::spawn(). Its frame
+// is freed when it returns.
+class queue_task {
+public:
+    struct promise_type {
+        queue_executor* executor = nullptr;
+
+        queue_task get_return_object() {
+            return queue_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never  final_suspend() noexcept;
+        void return_void() {}
+        void unhandled_exception();
+    };
+
+    queue_task(queue_task&& o) noexcept : h_(std::exchange(o.h_, {})) {}
+    ~queue_task() { if (h_) h_.destroy(); }     // never spawned
+
+private:
+    friend class queue_executor;
+    explicit queue_task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+
+    queue_task(queue_task const&) = delete;
+    void operator=(queue_task const&) = delete;
+};
+
+class queue_executor {
+public:
+    explicit queue_executor(std::size_t batch = 64,
+                            std::chrono::milliseconds max_idle = std::chrono::milliseconds(1))
+        : batch_(batch), max_idle_(max_idle), epoll_fd_(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (epoll_fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll_create1 failed");
+    }
+
+    ~queue_executor() {
+        for (auto& p : parked_) p.h.destroy();
+        for (auto h : ready_)   h.destroy();
+        close(epoll_fd_);
+    }
+
+    void spawn(queue_task t) {
+        auto h = std::exchange(t.h_, {});
+        h.promise().executor = this;
+        ready_.push_back(h);
+        live_++;
+    }
+
+    std::size_t tasks() const { return live_; }
+
+    // Runs the spawned tasks until all of them have returned. Rethrows the
+    // first exception that escapes a task; the other tasks stay suspended
+    // and run() may be called again.
+    void run() {
+        unsigned idle = 0;
+        while (live_) {
+            while (!ready_.empty()) {
+                auto h = ready_.front();
+                ready_.pop_front();
+                budget_ = batch_;
+                h.resume();
+                if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+            }
+            if (!live_) break;
+            if (poll_parked()) {
+                idle = 0;
+            } else if (++idle < spin_rounds) {
+                cpu_relax();
+            } else {
+                sleep();
+            }
+        }
+    }
+
+    // Called by the awaiters from await_suspend(). Tries the operation once
+    // more: on success the task keeps running while it has budget left, and
+    // is queued behind the other ready tasks otherwise. On failure it is
+    // parked until a retry succeeds.
+    template <typename Awaiter>
+    bool suspend(std::coroutine_handle<> h, Awaiter* a) {
+        if (a->retry()) {
+            if (budget_ > 0) {
+                budget_--;
+                return false;
+            }
+            ready_.push_back(h);
+            return true;
+        }
+        parked_t p { h, a, [](void* a) { return static_cast<Awaiter*>(a)->retry(); }, nullptr };
+        if constexpr (requires { a->arm(); }) {
+            if (watch(a->queue()))
+                p.arm = [](void* a) { return static_cast<Awaiter*>(a)->arm(); };
+        }
+        parked_.push_back(p);
+        return true;
+    }
+
+private:
+    friend struct queue_task::promise_type;
+
+    static constexpr unsigned spin_rounds = 64;
+
+    struct parked_t {
+        std::coroutine_handle<> h;
+        void* awaiter;
+        bool (*retry)(void*);           // completes the operation, true if it did
+        bool (*arm)(void*);             // arms the queue's notification fd, false if already ready
+    };
+
+    std::size_t                         batch_;
+    std::size_t                         budget_ = 0;
+    std::chrono::milliseconds           max_idle_;
+    int                                 epoll_fd_;
+    std::size_t                         live_ = 0;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::vector<parked_t>               parked_;
+    std::unordered_map<const void*, int> fds_;    // queue -> notification fd, -1 if it has none
+    std::exception_ptr                  error_;
+
+    queue_executor(queue_executor const&) = delete;
+    void operator=(queue_executor const&) = delete;
+
+    bool poll_parked() {
+        bool progress = false;
+        for (std::size_t i = 0; i < parked_.size();) {
+            if (parked_[i].retry(parked_[i].awaiter)) {
+                ready_.push_back(parked_[i].h);
+                parked_[i] = parked_.back();
+                parked_.pop_back();
+                progress = true;
+            } else {
+                i++;
+            }
+        }
+        return progress;
+    }
+
+    // Arms every pollable parked task and blocks in epoll_wait: without a
+    // timeout if all of them are pollable, for max_idle otherwise.
+    void sleep() {
+        bool all_armed = !parked_.empty();
+        for (auto& p : parked_) {
+            if (!p.arm)                    all_armed = false;
+            else if (!p.arm(p.awaiter))    return;           // became ready while arming
+        }
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd_, events, 64, all_armed ? -1 : static_cast<int>(max_idle_.count()));
+
+        // The fds are level-triggered, so drain them even if the task that
+        // armed one has been satisfied by polling in the meantime.
+        char buf[64];
+        for (int i = 0; i < n; i++)
+            while (read(events[i].data.fd, buf, sizeof(buf)) > 0) {}
+    }
+
+    // Adds the notification fd of `q` to the epoll set the first time a task
+    // parks on it. Returns false if the queue has none.
+    template <typename Queue>
+    bool watch(Queue& q) {
+        auto it = fds_.find(&q);
+        if (it == fds_.end()) {
+            int fd = -1;
+            try {
+                fd = q.notify_fd();
+            } catch (const std::exception&) {
+                // created without listener slots, or all of them taken: poll
+            }
+            if (fd >= 0) {
+                epoll_event ev {};
+                ev.events  = EPOLLIN;
+                ev.data.fd = fd;
+                if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) fd = -1;
+            }
+            it = fds_.emplace(&q, fd).first;
+        }
+        return it->second >= 0;
+    }
+};
+
+inline std::suspend_never queue_task::promise_type::final_suspend() noexcept {
+    executor->live_--;
+    return {};
+}
+
+inline void queue_task::promise_type::unhandled_exception() {
+    if (!executor->error_) executor->error_ = std::current_exception();
+}
+
+// co_await async_dequeue(q) yields the next message of `q`.
+template <typename Queue, typename Payload>
+class dequeue_awaiter {
+public:
+    explicit dequeue_awaiter(Queue& q) : q_(q) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) {
+        return h.promise().executor->suspend(h, this);
+    }
+
+    Payload await_resume() { return std::move(out_); }
+
+    bool   retry()  { return q_.dequeue(out_); }
+    Queue& queue()  { return q_; }
+    bool   arm() requires requires(Queue& q) { q.arm_notify(); } { return q_.arm_notify(); }
+
+private:
+    Queue&  q_;
+    Payload out_ {};
+};
+
+// co_await async_dequeue_bulk(q, out, n) moves up to `n` messages into
+// `out` and yields how many, at least one.
+template <typename Queue, typename Payload>
+class dequeue_bulk_awaiter {
+public:
+    dequeue_bulk_awaiter(Queue& q, Payload* out, std::size_t n) : q_(q), out_(out), n_(n) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) {
+        return h.promise().executor->suspend(h, this);
+    }
+
+    std::size_t await_resume() const { return got_; }
+
+    bool   retry()  { return (got_ = q_.dequeue_bulk(out_, n_)) != 0; }
+    Queue& queue()  { return q_; }
+    bool   arm() requires requires(Queue& q) { q.arm_notify(); } { return q_.arm_notify(); }
+
+private:
+    Queue&      q_;
+    Payload*    out_;
+    std::size_t n_;
+    std::size_t got_ = 0;
+};
+
+// co_await async_enqueue(q, v) returns once `v` is in `q`. There is no
+// notification for a full queue turning non-full, so this always polls.
+template <typename Queue, typename Payload>
+class enqueue_awaiter {
+public:
+    enqueue_awaiter(Queue& q, const Payload& v) : q_(q), v_(v) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) {
+        return h.promise().executor->suspend(h, this);
+    }
+
+    void await_resume() const noexcept {}
+
+    bool retry() { return q_.enqueue(v_); }
+
+private:
+    Queue&         q_;
+    const Payload& v_;
+};
+
+template <template <typename...> class Queue, typename Payload, typename... Rest>
+dequeue_awaiter<Queue<Payload, Rest...>, Payload> async_dequeue(Queue<Payload, Rest...>& q) {
+    return dequeue_awaiter<Queue<Payload, Rest...>, Payload>(q);
+}
+
+template <template <typename...> class Queue, typename Payload, typename... Rest>
+dequeue_bulk_awaiter<Queue<Payload, Rest...>, Payload>
+async_dequeue_bulk(Queue<Payload, Rest...>& q, Payload* out, std::size_t n) {
+    if (n == 0) throw std::invalid_argument("async_dequeue_bulk needs room for at least one message");
+    return dequeue_bulk_awaiter<Queue<Payload, Rest...>, Payload>(q, out, n);
+}
+
+template <template <typename...> class Queue, typename Payload, typename... Rest>
+enqueue_awaiter<Queue<Payload, Rest...>, Payload> async_enqueue(Queue<Payload, Rest...>& q, const Payload& v) {
+    return enqueue_awaiter<Queue<Payload, Rest...>, Payload>(q, v);
+}
@@ -0,0 +1,376 @@
+// Queue directory: many named queues, of different capacities and payload
+// types, carved out of one shared-memory segment. The segment is opened and
+// mapped once per process; after that, opening a queue is a hash lookup in
+// the directory table, not a shm_open + mmap, and all queues share one
+// mapping (and, with segment_options_t::huge_pages, a handful of TLB entries).
+//
+//     shm_queue_directory dir("/md", 256 << 20);      // arena bytes
+//     auto trades = dir.open<trade_t>("trades", 65536);
+//     auto quotes = dir.open<quote_t, packed_cells>("quotes", 1 << 20);
+//     trades.enqueue(t);
+//
+// The first open() of a name creates the queue, later ones (in any process)
+// attach to it and check its geometry like shm_mpmc_bounded_queue does.
+// Queues live as long as the directory segment: space is handed out from a
+// bump allocator and never reused.
+//
+// directory_queue handles are a pointer into the mapping. They are cheap to
+// copy and may be shared between threads, but must not outlive the
+// shm_queue_directory they came from. They support the plain and bulk
+// enqueue/dequeue calls and the blocking variants, not reservations, robust
+// producers, metrics or notification fds.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t default_directory_slots = 256;
+constexpr std::size_t directory_layout_flag   = 0x2000;   // header.layout of the directory itself
+constexpr std::size_t directory_name_max      = 63;       // bytes, without the terminating NUL
+
+// FNV-1a, so that every build hashes names the same way.
+inline std::uint64_t directory_hash(const std::string& name) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : name) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+}
+
+// Entry of the directory table, an open-addressed hash table keyed by name.
+// Entries are only filled in under the directory lock and published by
+// storing entry_ready into `state`, so lookups need no lock.
+struct alignas(cache_line) directory_entry_t {
+    std::atomic<std::uint32_t> state;       // 0 = free, entry_creating, entry_ready
+    std::uint64_t hash;
+    std::size_t   offset;                   // of the queue's queue_data_t, from the start of the segment
+    std::size_t   bytes;                    // reserved for the queue
+    char          name[directory_name_max + 1];
+};
+
+constexpr std::uint32_t entry_creating = 1;
+constexpr std::uint32_t entry_ready    = 2;
+
+// Control block at the start of a directory segment; the table follows it,
+// then the arena the queues are allocated from.
+struct directory_data_t {
+    segment_header_t header;        // capacity = table slots, cell_size = entry size
+    std::size_t slots;
+    std::size_t arena_offset;       // from the start of the segment
+    std::size_t arena_bytes;
+
+    // Serializes creation. Holds the pid of the creating process in the low
+    // half and the low 32 bits of its process_start_time() in the high half,
+    // 0 if free, so that the holder's identity changes in one CAS.
+    alignas(cache_line)
+    std::atomic<std::uint64_t> lock;
+    std::atomic<std::size_t>   arena_used;
+    std::atomic<std::size_t>   queues;
+
+    directory_entry_t* entries() {
+        return reinterpret_cast<directory_entry_t*>(reinterpret_cast<char*>(this) + sizeof(directory_data_t));
+    }
+};
+
+// Handle to one queue of a shm_queue_directory.
+template <typename Payload, typename Layout = padded_cells>
+class directory_queue {
+    using ring_t = ring_ops<Payload, Layout>;
+
+public:
+    directory_queue() = default;
+
+    explicit operator bool() const { return q_ != nullptr; }
+    std::size_t capacity() const { return q_->header.capacity; }
+
+    bool enqueue(const Payload& v) {
+        if (!ring_t::push(q_, v)) return false;
+        notify_waiters(q_->not_empty, q_->consumers_waiting, 1);
+        return true;
+    }
+
+    bool dequeue(Payload& out) {
+        if (!ring_t::pop(q_, out)) return false;
+        notify_waiters(q_->not_full, q_->producers_waiting, 1);
+        return true;
+    }
+
+    std::size_t enqueue_bulk(const Payload* items, std::size_t n) {
+        std::size_t k = 0;
+        while (k < n && ring_t::push(q_, items[k])) k++;
+        if (k) notify_waiters(q_->not_empty, q_->consumers_waiting, k);
+        return k;
+    }
+
+    std::size_t dequeue_bulk(Payload* out, std::size_t n) {
+        std::size_t k = 0;
+        while (k < n && ring_t::pop(q_, out[k])) k++;
+        if (k) notify_waiters(q_->not_full, q_->producers_waiting, k);
+        return k;
+    }
+
+    // The handle is shared between threads, so each call brings its own
+    // waiter instead of adapting a spin budget kept in the handle.
+    bool enqueue_wait(const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        adaptive_waiter waiter;
+        return waiter.wait_until([&] { return enqueue(v); }, q_->not_full, q_->producers_waiting, timeout);
+    }
+
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout) {
+        adaptive_waiter waiter;
+        return waiter.wait_until([&] { return dequeue(out); }, q_->not_empty, q_->consumers_waiting, timeout);
+    }
+
+private:
+    friend class shm_queue_directory;
+    explicit directory_queue(queue_data_t* q) : q_(q) {}
+
+    queue_data_t* q_ = nullptr;
+};
+
+class shm_queue_directory {
+public:
+    // `arena_bytes` and `slots` are only used by the creator; attachers take
+    // them from the segment header. `slots` bounds the number of queues and
+    // should leave some headroom, since the table is probed linearly.
+    explicit shm_queue_directory(const std::string& shm_name,
+                                 std::size_t arena_bytes = default_queue_size * cache_line,
+                                 std::size_t slots = default_directory_slots,
+                                 bool create_segment = true,
+                                 const segment_options_t& options = {})
+        : segment_(shm_name, create_segment, checked_segment_size(arena_bytes, slots), options),
+          data_(static_cast<directory_data_t*>(segment_.data())),
+          attach_timeout_(options.attach_timeout)
+    {
+        if (segment_.created()) {
+            init(arena_bytes, slots);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, directory_layout_flag, "layout");
+            segment_.check_field(h.cell_size, sizeof(directory_entry_t), "directory entry size");
+            if (data_->slots == 0 || data_->arena_offset != arena_offset(data_->slots) ||
+                data_->arena_offset + data_->arena_bytes > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+    }
+
+    std::size_t slots()       const { return data_->slots; }
+    std::size_t queues()      const { return data_->queues.load(std::memory_order_relaxed); }
+    std::size_t arena_bytes() const { return data_->arena_bytes; }
+    std::size_t arena_used()  const { return data_->arena_used.load(std::memory_order_relaxed); }
+
+    static std::size_t segment_size(std::size_t arena_bytes, std::size_t slots) {
+        return arena_offset(slots) + arena_bytes;
+    }
+
+    // Bytes a queue of `capacity` cells takes from the arena.
+    template <typename Payload, typename Layout = padded_cells>
+    static std::size_t queue_bytes(std::size_t capacity) {
+        return ring_ops<Payload, Layout>::block_bytes(capacity);
+    }
+
+    // Returns the queue called `name`, creating it with `capacity` cells if
+    // it does not exist yet and `create_queue` is set. An existing queue keeps
+    // its capacity, but must have been created with the same Payload and Layout.
+    template <typename Payload, typename Layout = padded_cells>
+    directory_queue<Payload, Layout> open(const std::string& name,
+                                          std::size_t capacity = default_queue_size,
+                                          bool create_queue = true) {
+        if (name.empty() || name.size() > directory_name_max)
+            throw std::invalid_argument("queue name must be 1 to " + std::to_string(directory_name_max) + " bytes");
+        auto hash = directory_hash(name);
+
+        auto* e = find(name, hash);
+        if (!e) {
+            if (!create_queue)
+                throw std::runtime_error(segment_.name() + ": no queue named " + name);
+            if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+                throw std::invalid_argument("capacity must be a power of 2");
+            e = create<Payload, Layout>(name, hash, capacity);
+        }
+        return directory_queue<Payload, Layout>(check<Payload, Layout>(name, e));
+    }
+
+    // Whether a queue called `name` exists.
+    bool contains(const std::string& name) {
+        return name.size() <= directory_name_max && find(name, directory_hash(name)) != nullptr;
+    }
+
+private:
+    shm_segment              segment_;
+    directory_data_t*        data_;
+    std::chrono::nanoseconds attach_timeout_;
+
+    shm_queue_directory(shm_queue_directory const&) = delete;
+    void operator=(shm_queue_directory const&) = delete;
+
+    static std::size_t arena_offset(std::size_t slots) {
+        return sizeof(directory_data_t) + slots * sizeof(directory_entry_t);
+    }
+
+    queue_data_t* queue_at(const directory_entry_t* e) {
+        return reinterpret_cast<queue_data_t*>(static_cast<char*>(segment_.data()) + e->offset);
+    }
+
+    // Lock-free lookup. Probing stops at the first free entry; entries are
+    // never freed, except ones whose creator died before publishing them,
+    // and no other entry can have been added behind those.
+    directory_entry_t* find(const std::string& name, std::uint64_t hash) {
+        auto* table = data_->entries();
+        for (std::size_t i = 0; i < data_->slots; i++) {
+            auto& e     = table[(hash + i) % data_->slots];
+            auto  state = e.state.load(std::memory_order_acquire);
+            if (state == 0) return nullptr;
+            if (state == entry_ready && e.hash == hash && name == e.name) return &e;
+        }
+        return nullptr;
+    }
+
+    template <typename Payload, typename Layout>
+    directory_entry_t* create(const std::string& name, std::uint64_t hash, std::size_t capacity) {
+        lock();
+        try {
+            // someone may have created it while we waited for the lock
+            if (auto* e = find(name, hash)) {
+                unlock();
+                return e;
+            }
+            auto bytes = queue_bytes<Payload, Layout>(capacity);
+            auto used  = data_->arena_used.load(std::memory_order_relaxed);
+            if (bytes > data_->arena_bytes - used)
+                throw std::runtime_error(segment_.name() + ": not enough room for queue " + name + " (" +
+                                         std::to_string(bytes) + " bytes, " +
+                                         std::to_string(data_->arena_bytes - used) + " left)");
+
+            directory_entry_t* e = nullptr;
+            auto* table = data_->entries();
+            for (std::size_t i = 0; i < data_->slots && !e; i++) {
+                auto& slot = table[(hash + i) % data_->slots];
+                if (slot.state.load(std::memory_order_relaxed) != entry_ready) e = &slot;
+            }
+            if (!e) throw std::runtime_error(segment_.name() + ": directory table is full");
+
+            // Claim the entry first: if we die while initializing the queue,
+            // the next creator frees it again.
+            e->state.store(entry_creating, std::memory_order_relaxed);
+            e->hash   = hash;
+            e->offset = data_->arena_offset + used;
+            e->bytes  = bytes;
+            std::memcpy(e->name, name.c_str(), name.size() + 1);
+
+            auto* q = queue_at(e);
+            init_queue<Payload, Layout>(q, capacity);
+            segment_.publish_header(q->header);
+            data_->arena_used.store(used + bytes, std::memory_order_relaxed);
+            data_->queues.fetch_add(1, std::memory_order_relaxed);
+            e->state.store(entry_ready, std::memory_order_release);
+            unlock();
+            return e;
+        } catch (...) {
+            unlock();
+            throw;
+        }
+    }
+
+    template <typename Payload, typename Layout>
+    queue_data_t* check(const std::string& name, const directory_entry_t* e) {
+        using cells_t = typename Layout::template cells<Payload>;
+        auto* q = queue_at(e);
+        const auto& h = q->header;
+        auto what = [&](const char* field) { return "queue " + name + ": " + field; };
+        segment_.check_field(h.layout,        Layout::id,        what("cell layout").c_str());
+        segment_.check_field(h.payload_size,  sizeof(Payload),   what("payload size").c_str());
+        segment_.check_field(h.payload_align, alignof(Payload),  what("payload alignment").c_str());
+        segment_.check_field(h.cell_size,     cells_t::stride,   what("cell size").c_str());
+        if (queue_bytes<Payload, Layout>(h.capacity) > e->bytes)
+            throw std::runtime_error(segment_.name() + ": queue " + name + " is smaller than its header says");
+        return q;
+    }
+
+    // Creation lock. A holder that died is detected by its pid and start
+    // time, so a reused pid does not keep the lock; whatever entry it was
+    // creating is freed. arena_used only moves once an entry is complete,
+    // so the arena space the dead holder was filling is handed out again.
+    void lock() {
+        auto pid      = getpid();
+        auto self     = lock_word(pid, process_start_time(pid));
+        auto deadline = std::chrono::steady_clock::now() + attach_timeout_;
+        for (unsigned spins = 0;; spins++) {
+            std::uint64_t holder = 0;
+            if (data_->lock.compare_exchange_weak(holder, self, std::memory_order_acquire))
+                break;
+            if (holder != 0 && !lock_holder_alive(holder) &&
+                data_->lock.compare_exchange_strong(holder, self, std::memory_order_acquire)) {
+                release_orphans();
+                break;
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+                throw std::runtime_error(segment_.name() + ": directory lock held by pid " +
+                                         std::to_string(static_cast<std::int32_t>(holder)));
+            if (spins < 64) cpu_relax();
+            else            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    void unlock() {
+        data_->lock.store(0, std::memory_order_release);
+    }
+
+    static std::uint64_t lock_word(pid_t pid, std::uint64_t start_time) {
+        return start_time << 32 | static_cast<std::uint32_t>(pid);
+    }
+
+    // process_alive() on the halves of a lock word. Only the low 32 bits of
+    // the start time are compared; clock ticks since boot wrap them after
+    // more than a year at the usual 100 Hz.
+    static bool lock_holder_alive(std::uint64_t word) {
+        auto pid = static_cast<pid_t>(static_cast<std::uint32_t>(word));
+        if (kill(pid, 0) != 0 && errno == ESRCH) return false;
+        return lock_word(pid, process_start_time(pid)) == word;
+    }
+
+    void release_orphans() {
+        auto* table = data_->entries();
+        for (std::size_t i = 0; i < data_->slots; i++)
+            if (table[i].state.load(std::memory_order_relaxed) == entry_creating)
+                table[i].state.store(0, std::memory_order_relaxed);
+    }
+
+    void init(std::size_t arena_bytes, std::size_t slots) {
+        auto* d = data_;
+        d->header.capacity      = slots;
+        d->header.cell_size     = sizeof(directory_entry_t);
+        d->header.payload_size  = 0;
+        d->header.payload_align = 0;
+        d->header.layout        = directory_layout_flag;
+        d->slots        = slots;
+        d->arena_offset = arena_offset(slots);
+        d->arena_bytes  = arena_bytes;
+        d->lock.store(0, std::memory_order_relaxed);
+        d->arena_used.store(0, std::memory_order_relaxed);
+        d->queues.store(0, std::memory_order_relaxed);
+        for (std::size_t i = 0; i < slots; i++)
+            new (&d->entries()[i]) directory_entry_t{};
+    }
+
+    static std::size_t checked_segment_size(std::size_t arena_bytes, std::size_t slots) {
+        if (slots == 0)
+            throw std::invalid_argument("a queue directory needs at least one slot");
+        return segment_size(arena_bytes, slots);
+    }
+};
@@ -0,0 +1,450 @@
+// Growable MPMC queue: a chain of fixed-size Vyukov rings ("blocks") taken
+// from a pool in one segment. While consumers keep up, the chain is a single
+// block and the queue behaves like shm_mpmc_bounded_queue. When a producer
+// finds the tail block full, it takes a free block from the pool, closes the
+// full one and links the new one behind it, so a burst is absorbed instead
+// of stalling the producers. Consumers drain the blocks in chain order and
+// hand every drained block back to the pool.
+//
+// The pool is the hard memory cap: enqueue() only returns false once every
+// block is in use. The segment is sized for the whole pool, but pages of
+// blocks that were never used are not faulted in: a fresh segment is all
+// zeroes, which reads as a free block, so block headers and rings are only
+// written when a block is first linked, and nothing scans past the highest
+// block handed out so far.
+//
+// Closing a block sets a bit in its enqueue_pos, so a producer's CAS fails
+// once the block is closed and everything enqueued into a block is ordered
+// before everything in the next one. While an operation runs, its handle
+// lists the block it enqueues into or dequeues from in a table in the
+// segment (hazard pointers); a block is only reused once no handle lists it.
+// The listing is cleared when the operation returns, so an idle or
+// one-sided handle never keeps a block out of the pool. The common path is
+// the plain ring operation plus the pin and a test of the closed bit; the
+// bulk calls pin once per batch.
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t   growable_layout_flag = 0x4000;     // or-ed into header.layout
+constexpr std::size_t   block_closed         = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+constexpr std::uint32_t no_block             = UINT32_MAX;
+
+}
+
+// Block states. A retired block is drained and unlinked, and becomes free
+// for reuse once no handle lists it anymore.
+constexpr std::uint32_t block_free    = 0;
+constexpr std::uint32_t block_linked  = 1;
+constexpr std::uint32_t block_retired = 2;
+
+// Header of a pool block; its ring (a queue_data_t and the cells) follows.
+struct alignas(cache_line) chain_block_t {
+    std::atomic<std::uint32_t> state;
+    std::atomic<std::uint32_t> next;        // following block in the chain, no_block if none yet
+
+    queue_data_t* ring() {
+        return reinterpret_cast<queue_data_t*>(reinterpret_cast<char*>(this) + sizeof(chain_block_t));
+    }
+};
+
+// Entry of the handle table: the blocks a handle may be touching.
+struct alignas(cache_line) chain_handle_t {
+    std::atomic<std::int32_t>  pid;                 // 0 = free, -pid while registering
+    std::atomic<std::uint64_t> start_time;          // see process_start_time()
+    std::atomic<std::uint32_t> enqueue_block;       // no_block if none
+    std::atomic<std::uint32_t> dequeue_block;
+};
+
+// Control block at the start of a growable segment; the handle table follows
+// it, then the block pool.
+struct growable_data_t {
+    segment_header_t header;        // describes a single block
+    std::size_t blocks;
+    std::size_t block_bytes;        // stride between blocks
+    std::size_t handle_slots;
+    std::atomic<std::uint32_t> touched;             // blocks below this index have been linked at least once
+
+    alignas(cache_line)
+    std::atomic<std::uint32_t> head;                // block consumers drain
+
+    alignas(cache_line)
+    std::atomic<std::uint32_t> tail;                // block producers fill
+
+    // Futex words, see queue_data_t. not_full is only waited on once the
+    // pool is exhausted.
+    alignas(cache_line)
+    std::atomic<std::uint32_t> not_empty;
+    std::atomic<std::uint32_t> consumers_waiting;
+    std::atomic<std::uint32_t> not_full;
+    std::atomic<std::uint32_t> producers_waiting;
+
+    chain_handle_t* handles() {
+        return reinterpret_cast<chain_handle_t*>(reinterpret_cast<char*>(this) + sizeof(growable_data_t));
+    }
+
+    chain_block_t* block(std::size_t i) {
+        return reinterpret_cast<chain_block_t*>(reinterpret_cast<char*>(handles()) +
+                                                handle_slots * sizeof(chain_handle_t) + i * block_bytes);
+    }
+};
+
+template <typename Payload, typename Layout = padded_cells>
+class shm_growable_queue {
+    using cells_t = typename Layout::template cells<Payload>;
+    using ring_t  = ring_ops<Payload, Layout>;
+
+public:
+    static constexpr bool growable = true;
+
+    // `block_capacity` and `memory_cap` are only used by the creator;
+    // attachers take them from the segment header. The pool gets as many
+    // blocks as fit into `memory_cap` bytes, at least one.
+    explicit shm_growable_queue(const std::string& shm_name,
+                                std::size_t block_capacity = default_queue_size / 16,
+                                std::size_t memory_cap = 16 * block_bytes(default_queue_size / 16),
+                                bool create_segment = true,
+                                const segment_options_t& options = {})
+        : segment_(shm_name, create_segment,
+                   checked_segment_size(block_capacity, memory_cap, options.handle_slots), options),
+          data_(static_cast<growable_data_t*>(segment_.data()))
+    {
+        if (segment_.created()) {
+            init(block_capacity, memory_cap / block_bytes(block_capacity), options.handle_slots);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, Layout::id | growable_layout_flag, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, cells_t::stride, "cell size");
+            segment_.check_field(data_->block_bytes, block_bytes(h.capacity), "block size");
+            if (data_->blocks == 0 ||
+                segment_size(h.capacity, data_->blocks, data_->handle_slots) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        register_handle();
+    }
+
+    ~shm_growable_queue() {
+        self_->enqueue_block.store(no_block, std::memory_order_relaxed);
+        self_->dequeue_block.store(no_block, std::memory_order_relaxed);
+        self_->pid.store(0, std::memory_order_release);
+    }
+
+    std::size_t block_capacity() const { return data_->header.capacity; }
+    std::size_t max_blocks()     const { return data_->blocks; }
+
+    // Blocks currently in the chain (1 while consumers keep up).
+    std::size_t blocks_in_use() const {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < data_->touched.load(std::memory_order_relaxed); i++)
+            n += data_->block(i)->state.load(std::memory_order_relaxed) == block_linked;
+        return n;
+    }
+
+    static std::size_t block_bytes(std::size_t block_capacity) {
+        return sizeof(chain_block_t) + ring_t::block_bytes(block_capacity);
+    }
+
+    static std::size_t segment_size(std::size_t block_capacity, std::size_t blocks, std::size_t handle_slots) {
+        return sizeof(growable_data_t) + handle_slots * sizeof(chain_handle_t) + blocks * block_bytes(block_capacity);
+    }
+
+    // Returns false only if the tail block is full and the pool is exhausted.
+    bool enqueue(const Payload& v) {
+        enqueue_into_ = pin(data_->tail, self_->enqueue_block);
+        bool ok = push(v);
+        unpin(self_->enqueue_block);
+        if (!ok) return false;
+        notify_waiters(data_->not_empty, data_->consumers_waiting, 1);
+        return true;
+    }
+
+    bool dequeue(Payload& out) {
+        dequeue_from_ = pin(data_->head, self_->dequeue_block);
+        bool ok = pop(out);
+        unpin(self_->dequeue_block);
+        if (!ok) return false;
+        notify_waiters(data_->not_full, data_->producers_waiting, 1);
+        return true;
+    }
+
+    std::size_t enqueue_bulk(const Payload* items, std::size_t n) {
+        std::size_t k = 0;
+        enqueue_into_ = pin(data_->tail, self_->enqueue_block);
+        while (k < n && push(items[k])) k++;
+        unpin(self_->enqueue_block);
+        if (k) notify_waiters(data_->not_empty, data_->consumers_waiting, k);
+        return k;
+    }
+
+    std::size_t dequeue_bulk(Payload* out, std::size_t n) {
+        std::size_t k = 0;
+        dequeue_from_ = pin(data_->head, self_->dequeue_block);
+        while (k < n && pop(out[k])) k++;
+        unpin(self_->dequeue_block);
+        if (k) notify_waiters(data_->not_full, data_->producers_waiting, k);
+        return k;
+    }
+
+    bool enqueue_wait(const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        return waiter_.wait_until([&] { return enqueue(v); },
+                                  data_->not_full, data_->producers_waiting, timeout);
+    }
+
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout) {
+        return waiter_.wait_until([&] { return dequeue(out); },
+                                  data_->not_empty, data_->consumers_waiting, timeout);
+    }
+
+private:
+    shm_segment      segment_;
+    growable_data_t* data_;
+    chain_handle_t*  self_         = nullptr;
+    std::uint32_t    enqueue_into_ = no_block;     // pinned in self_->enqueue_block during an enqueue
+    std::uint32_t    dequeue_from_ = no_block;     // pinned in self_->dequeue_block during a dequeue
+    adaptive_waiter  waiter_;
+
+    shm_growable_queue(shm_growable_queue const&) = delete;
+    void operator=(shm_growable_queue const&) = delete;
+
+    enum class push_result { pushed, full, closed };
+
+    // ring_ops::push, except that it refuses closed rings. Closing changes
+    // enqueue_pos, so a CAS that races with it fails and sees the bit.
+    static push_result try_push(queue_data_t* q, const Payload& v) {
+        auto pos = q->enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            if (pos & block_closed) return push_result::closed;
+            auto& seq = ring_t::seq_at(q, pos);
+            auto  dif = static_cast<std::intptr_t>(seq.load(std::memory_order_acquire)) -
+                        static_cast<std::intptr_t>(pos);
+            if (dif == 0) {
+                if (q->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    ring_t::data_at(q, pos) = v;
+                    seq.store(pos + 1, std::memory_order_release);
+                    return push_result::pushed;
+                }
+            } else if (dif < 0) {
+                return push_result::full;
+            } else {
+                pos = q->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool push(const Payload& v) {
+        for (;;) {
+            auto* b = data_->block(enqueue_into_);
+            auto  r = try_push(b->ring(), v);
+            if (r == push_result::pushed) return true;
+            if (!extend(enqueue_into_, b)) return false;
+            enqueue_into_ = pin(data_->tail, self_->enqueue_block);
+        }
+    }
+
+    bool pop(Payload& out) {
+        for (;;) {
+            auto* b = data_->block(dequeue_from_);
+            auto* q = b->ring();
+            if (ring_t::pop(q, out)) return true;
+
+            // Empty. Move on only once the block is closed and every claimed
+            // cell in it has been consumed.
+            auto end = q->enqueue_pos.load(std::memory_order_acquire);
+            if (!(end & block_closed) || q->dequeue_pos.load(std::memory_order_relaxed) != (end & ~block_closed))
+                return false;
+            auto next = b->next.load(std::memory_order_acquire);
+            if (next == no_block) return false;        // closed, but its successor is not linked yet
+
+            auto expected = dequeue_from_;
+            if (data_->head.compare_exchange_strong(expected, next, std::memory_order_acq_rel))
+                retire(dequeue_from_, next);
+            dequeue_from_ = pin(data_->head, self_->dequeue_block);
+        }
+    }
+
+    // Makes sure full or closed block `i` has a successor and that the tail
+    // has moved past it. Returns false if a successor is needed and the pool
+    // is exhausted. Anybody may finish the job of a producer that closed a
+    // block and died before linking it.
+    bool extend(std::uint32_t i, chain_block_t* b) {
+        auto next = b->next.load(std::memory_order_acquire);
+        if (next == no_block) {
+            auto fresh = allocate();
+            if (fresh == no_block) return false;
+            b->ring()->enqueue_pos.fetch_or(block_closed, std::memory_order_relaxed);
+            if (b->next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+                next = fresh;
+            else
+                data_->block(fresh)->state.store(block_free, std::memory_order_release);
+        }
+        data_->tail.compare_exchange_strong(i, next, std::memory_order_acq_rel);
+        return true;
+    }
+
+    // Called by the consumer that moved the head from block `i` to `next`.
+    void retire(std::uint32_t i, std::uint32_t next) {
+        auto expected = i;
+        data_->tail.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+        data_->block(i)->state.store(block_retired, std::memory_order_release);
+        notify_waiters(data_->not_full, data_->producers_waiting, SIZE_MAX);
+    }
+
+    // Takes a free block, or a retired one that no handle lists, and resets
+    // its ring.
+    std::uint32_t allocate() {
+        for (std::uint32_t i = 0; i < data_->blocks; i++) {
+            auto* b     = data_->block(i);
+            auto  state = b->state.load(std::memory_order_relaxed);
+            if (state == block_linked) continue;
+            if (state == block_retired) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);   // pairs with the one in pin()
+                if (pinned(i)) continue;
+            }
+            if (!b->state.compare_exchange_strong(state, block_linked, std::memory_order_acquire))
+                continue;
+            b->next.store(no_block, std::memory_order_relaxed);
+            init_queue<Payload, Layout>(b->ring(), data_->header.capacity);
+            auto touched = data_->touched.load(std::memory_order_relaxed);
+            while (touched <= i &&
+                   !data_->touched.compare_exchange_weak(touched, i + 1, std::memory_order_relaxed)) {}
+            return i;
+        }
+        return no_block;
+    }
+
+    // Whether some live handle lists block `i`. The acquire loads pair with
+    // unpin(), so everything the handle did to the block happens before it
+    // is reset. Entries of handles whose
+    // process has exited are freed on the way.
+    bool pinned(std::uint32_t i) {
+        auto* table = data_->handles();
+        for (std::size_t h = 0; h < data_->handle_slots; h++) {
+            auto& e = table[h];
+            if (e.enqueue_block.load(std::memory_order_acquire) != i &&
+                e.dequeue_block.load(std::memory_order_acquire) != i)
+                continue;
+            auto pid = e.pid.load(std::memory_order_acquire);
+            if (pid > 0 && !process_alive(pid, e.start_time.load(std::memory_order_relaxed)) &&
+                e.pid.compare_exchange_strong(pid, 0, std::memory_order_acq_rel)) {
+                e.enqueue_block.store(no_block, std::memory_order_relaxed);
+                e.dequeue_block.store(no_block, std::memory_order_relaxed);
+                continue;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Reads the block index in `at`, lists it in `slot` and reads it again:
+    // if it has not changed, the block cannot have been recycled before the
+    // listing became visible to allocate().
+    std::uint32_t pin(std::atomic<std::uint32_t>& at, std::atomic<std::uint32_t>& slot) {
+        auto i = at.load(std::memory_order_acquire);
+        for (;;) {
+            slot.store(i, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto again = at.load(std::memory_order_acquire);
+            if (again == i) return i;
+            i = again;
+        }
+    }
+
+    // Ends an operation: the block pinned in `slot` may be recycled again.
+    static void unpin(std::atomic<std::uint32_t>& slot) {
+        slot.store(no_block, std::memory_order_release);
+    }
+
+    void register_handle() {
+        auto* table = data_->handles();
+        auto  pid   = static_cast<std::int32_t>(getpid());
+        auto  start = process_start_time(pid);
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (std::size_t i = 0; i < data_->handle_slots; i++) {
+                std::int32_t expected = 0;
+                auto& e = table[i];
+                if (!e.pid.compare_exchange_strong(expected, -pid, std::memory_order_acquire))
+                    continue;
+                e.start_time.store(start, std::memory_order_relaxed);
+                e.enqueue_block.store(no_block, std::memory_order_relaxed);
+                e.dequeue_block.store(no_block, std::memory_order_relaxed);
+                e.pid.store(pid, std::memory_order_release);
+                self_ = &e;
+                return;
+            }
+            reap_handles();
+        }
+        throw std::runtime_error("handle table is full");
+    }
+
+    void reap_handles() {
+        auto* table = data_->handles();
+        for (std::size_t i = 0; i < data_->handle_slots; i++) {
+            auto& e   = table[i];
+            auto  pid = e.pid.load(std::memory_order_acquire);
+            if (pid <= 0 || process_alive(pid, e.start_time.load(std::memory_order_relaxed)))
+                continue;
+            e.enqueue_block.store(no_block, std::memory_order_relaxed);
+            e.dequeue_block.store(no_block, std::memory_order_relaxed);
+            e.pid.compare_exchange_strong(pid, 0, std::memory_order_release);
+        }
+    }
+
+    void init(std::size_t block_capacity, std::size_t blocks, std::size_t handle_slots) {
+        auto* d = data_;
+        d->header.capacity      = block_capacity;
+        d->header.cell_size     = cells_t::stride;
+        d->header.payload_size  = sizeof(Payload);
+        d->header.payload_align = alignof(Payload);
+        d->header.layout        = Layout::id | growable_layout_flag;
+        d->blocks       = blocks;
+        d->block_bytes  = block_bytes(block_capacity);
+        d->handle_slots = handle_slots;
+        d->head.store(0, std::memory_order_relaxed);
+        d->tail.store(0, std::memory_order_relaxed);
+        d->not_empty.store(0, std::memory_order_relaxed);
+        d->consumers_waiting.store(0, std::memory_order_relaxed);
+        d->not_full.store(0, std::memory_order_relaxed);
+        d->producers_waiting.store(0, std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < handle_slots; i++) {
+            new (&d->handles()[i]) chain_handle_t{};
+            d->handles()[i].enqueue_block.store(no_block, std::memory_order_relaxed);
+            d->handles()[i].dequeue_block.store(no_block, std::memory_order_relaxed);
+        }
+        // Only the first block is set up here. The others stay all zeroes,
+        // i.e. block_free, until allocate() first links them.
+        auto* first = new (d->block(0)) chain_block_t{};
+        first->next.store(no_block, std::memory_order_relaxed);
+        first->state.store(block_linked, std::memory_order_relaxed);
+        init_queue<Payload, Layout>(first->ring(), block_capacity);
+        d->touched.store(1, std::memory_order_relaxed);
+    }
+
+    static std::size_t checked_segment_size(std::size_t block_capacity, std::size_t memory_cap,
+                                            std::size_t handle_slots) {
+        if (block_capacity < 2 || (block_capacity & (block_capacity - 1)) != 0)
+            throw std::invalid_argument("block capacity must be a power of 2");
+        if (memory_cap < block_bytes(block_capacity))
+            throw std::invalid_argument("memory cap is smaller than one block");
+        if (memory_cap / block_bytes(block_capacity) >= no_block)
+            throw std::invalid_argument("memory cap allows too many blocks");
+        if (handle_slots == 0)
+            throw std::invalid_argument("a growable queue needs at least one handle slot");
+        return segment_size(block_capacity, memory_cap / block_bytes(block_capacity), handle_slots);
+    }
+};
@@ -0,0 +1,477 @@
+// Append-only journal of fixed-size records in memory-mapped files, and a
+// queue that mirrors every message into one, so that messages survive a
+// crash or reboot and can be replayed.
+//
+// Records are numbered by a sequence shared by all writers. Record `seq`
+// lives in file `seq / records_per_file` of the journal directory at a fixed
+// offset, so any process finds it without an index, and a replay is a
+// sequential walk over mapped memory. A record is complete once its stamp
+// equals seq + 1 and its checksum matches. Files are created zero-filled,
+// so a record torn by a process crash never gets its stamp. A host crash
+// can persist the page holding the stamp but not the one holding the rest
+// of a record that straddles pages; the checksum catches that.
+//
+// Writes go to the page cache through the mapping, which already survives
+// the writer process dying. Surviving a host crash needs msync(): with
+// sync_every or sync_interval set, the appender that crosses the boundary
+// flushes the journal for everybody (group commit), and sync() does it on
+// demand. Nothing on the append path allocates; a file is only created and
+// mapped when the sequence enters it.
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t journal_layout_flag = 0x1000;   // or-ed into header.layout
+
+}
+
+struct journal_options_t {
+    std::size_t records_per_file = 1 << 20;            // creator only; attachers take it from the head
+    std::size_t sync_every       = 0;                  // msync after this many appends, 0 = never
+    std::chrono::nanoseconds sync_interval = std::chrono::nanoseconds::zero();  // ... or this long after the last one
+    std::chrono::nanoseconds attach_timeout = std::chrono::seconds(1);
+};
+
+// The "head" file of a journal directory. Unlike a shm segment it outlives
+// every process, so the sequence carries on after a restart.
+struct journal_head_t {
+    segment_header_t header;        // capacity = records per file, cell_size = record size
+
+    alignas(cache_line)
+    std::atomic<std::uint64_t> next_seq;
+    std::atomic<std::uint64_t> last_sync;   // steady clock of the last group commit, in ns
+};
+
+template <typename Payload>
+struct journal_record_t {
+    std::atomic<std::uint64_t> stamp;       // seq + 1 once complete, 0 before
+    std::uint64_t check;                    // journal_checksum() of seq and data
+    Payload data;
+};
+
+namespace {
+
+// Word-at-a-time hash of a record's payload, seeded with its sequence
+// number so that a record never matches at another position.
+inline std::uint64_t journal_checksum(std::uint64_t seq, const void* data, std::size_t len) {
+    auto* p = static_cast<const unsigned char*>(data);
+    std::uint64_t h = (seq + 1) * 0x9e3779b97f4a7c15ull;
+    for (; len >= 8; p += 8, len -= 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    if (len) {
+        std::uint64_t w = 0;
+        std::memcpy(&w, p, len);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+    }
+    return h ^ (h >> 29);
+}
+
+}
+
+template <typename Payload>
+class shm_journal {
+    static_assert(std::is_trivially_copyable_v<Payload>, "journal payloads are written to disk as bytes");
+
+    using record_t = journal_record_t<Payload>;
+
+public:
+    // Opens the journal in `dir`, creating the directory and its head if
+    // `create` is set and they do not exist yet.
+    explicit shm_journal(const std::string& dir, bool create = true, const journal_options_t& options = {})
+        : dir_(dir), sync_every_(options.sync_every), sync_interval_(options.sync_interval)
+    {
+        if (create && mkdir(dir_.c_str(), 0777) != 0 && errno != EEXIST)
+            throw std::runtime_error(dir_ + ": cannot create journal directory");
+        if (options.records_per_file == 0)
+            throw std::invalid_argument("a journal file needs room for at least one record");
+        open_head(create, options);
+    }
+
+    ~shm_journal() {
+        for (auto& m : maps_) unmap(m);
+        munmap(head_, sizeof(journal_head_t));
+    }
+
+    std::uint64_t next_seq()         const { return head_->next_seq.load(std::memory_order_acquire); }
+    std::size_t   records_per_file() const { return per_file_; }
+
+    // Appends `v` and returns its sequence number.
+    std::uint64_t append(const Payload& v) {
+        auto  seq = head_->next_seq.fetch_add(1, std::memory_order_relaxed);
+        auto* r   = record(seq, true);
+        r->data  = v;
+        r->check = journal_checksum(seq, &r->data, sizeof(Payload));     // the stored bytes, padding included
+        r->stamp.store(seq + 1, std::memory_order_release);
+        if (sync_every_ && (seq + 1) % sync_every_ == 0)
+            sync();
+        else if (sync_interval_.count())
+            sync_if_due();
+        return seq;
+    }
+
+    // Copies record `seq` into `out`. False if it is not complete (yet), is
+    // torn, or its file has been trimmed.
+    bool read(std::uint64_t seq, Payload& out) {
+        auto* r = record(seq, false);
+        if (!r || r->stamp.load(std::memory_order_acquire) != seq + 1) return false;
+        if (r->check != journal_checksum(seq, &r->data, sizeof(Payload))) return false;
+        out = r->data;
+        return true;
+    }
+
+    // Calls fn(seq, payload) for every complete record from `from` up to the
+    // sequence at the time of the call, in order, and returns that sequence.
+    // An incomplete record is waited for up to `hole_timeout`: a live writer
+    // finishes it within microseconds, while one that died never will and
+    // is skipped. So is a record whose checksum does not match.
+    template <typename Fn>
+    std::uint64_t replay(std::uint64_t from, Fn&& fn,
+                         std::chrono::nanoseconds hole_timeout = std::chrono::milliseconds(10)) {
+        auto end = next_seq();
+        for (auto seq = from; seq < end; seq++) {
+            auto* r = record(seq, false);
+            if (!r) continue;                          // trimmed
+            if (r->stamp.load(std::memory_order_acquire) != seq + 1) {
+                auto deadline = std::chrono::steady_clock::now() + hole_timeout;
+                while (r->stamp.load(std::memory_order_acquire) != seq + 1 &&
+                       std::chrono::steady_clock::now() < deadline)
+                    std::this_thread::yield();
+                if (r->stamp.load(std::memory_order_acquire) != seq + 1) continue;
+            }
+            if (r->check != journal_checksum(seq, &r->data, sizeof(Payload))) continue;     // torn by a host crash
+            fn(seq, static_cast<const Payload&>(r->data));
+        }
+        return end;
+    }
+
+    // Group commit: flushes the files this handle has mapped, then the head.
+    void sync() {
+        for (auto& m : maps_)
+            if (m.records) msync(m.records, file_bytes(), MS_SYNC);
+        msync(head_, sizeof(journal_head_t), MS_SYNC);
+        head_->last_sync.store(now_ns(), std::memory_order_relaxed);
+    }
+
+    // Deletes the files that only hold records below `before`. Returns how
+    // many were deleted.
+    std::size_t trim(std::uint64_t before) {
+        std::size_t n = 0;
+        for (std::uint64_t f = before / per_file_; f-- > 0;) {
+            for (auto& m : maps_)
+                if (m.file == f) unmap(m);
+            if (unlink(file_path(f).c_str()) != 0) break;     // trimmed before
+            n++;
+        }
+        return n;
+    }
+
+private:
+    struct mapping_t {
+        std::uint64_t file    = ~std::uint64_t(0);
+        record_t*     records = nullptr;
+    };
+
+    std::string              dir_;
+    journal_head_t*          head_     = nullptr;
+    std::size_t              per_file_ = 0;
+    std::size_t              sync_every_;
+    std::chrono::nanoseconds sync_interval_;
+    mapping_t                maps_[2];          // the two files used last, most recent first
+
+    shm_journal(shm_journal const&) = delete;
+    void operator=(shm_journal const&) = delete;
+
+    std::size_t file_bytes() const { return per_file_ * sizeof(record_t); }
+
+    std::string file_path(std::uint64_t file) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%016llx.journal", static_cast<unsigned long long>(file));
+        return dir_ + name;
+    }
+
+    record_t* record(std::uint64_t seq, bool create) {
+        auto f = seq / per_file_;
+        if (maps_[0].file != f) {
+            if (maps_[1].file == f) {
+                std::swap(maps_[0], maps_[1]);
+            } else {
+                auto* p = map_file(f, create);
+                if (!p) return nullptr;
+                unmap(maps_[1]);
+                maps_[1] = maps_[0];
+                maps_[0] = { f, p };
+            }
+        }
+        return &maps_[0].records[seq % per_file_];
+    }
+
+    // Files are sized once and never shrink, so racing creators agree.
+    record_t* map_file(std::uint64_t file, bool create) {
+        auto path = file_path(file);
+        int  fd   = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+        if (fd < 0) {
+            if (!create) return nullptr;
+            throw std::runtime_error(path + ": cannot open journal file");
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0 ||
+            (static_cast<std::size_t>(st.st_size) < file_bytes() && ftruncate(fd, file_bytes()) != 0)) {
+            close(fd);
+            throw std::runtime_error(path + ": cannot size journal file");
+        }
+        void* p = mmap(nullptr, file_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error(path + ": cannot map journal file");
+        return static_cast<record_t*>(p);
+    }
+
+    void unmap(mapping_t& m) {
+        if (m.records) munmap(m.records, file_bytes());
+        m = {};
+    }
+
+    void sync_if_due() {
+        auto now  = now_ns();
+        auto last = head_->last_sync.load(std::memory_order_relaxed);
+        if (now - last >= static_cast<std::uint64_t>(sync_interval_.count()) &&
+            head_->last_sync.compare_exchange_strong(last, now, std::memory_order_relaxed))
+            sync();
+    }
+
+    static std::uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Same protocol as a shm segment: exactly one creator (O_EXCL) fills in
+    // the head and publishes it, everyone else waits for that and checks it.
+    void open_head(bool create, const journal_options_t& options) {
+        auto path  = dir_ + "/head";
+        bool owner = false;
+        int  fd    = -1;
+        if (create) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            owner = fd >= 0;
+        }
+        if (fd < 0) fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error(path + ": cannot open journal head");
+
+        auto fail = [&](const char* what) {
+            close(fd);
+            throw std::runtime_error(path + ": " + what);
+        };
+        auto deadline = std::chrono::steady_clock::now() + options.attach_timeout;
+        if (owner) {
+            if (ftruncate(fd, sizeof(journal_head_t)) != 0) fail("cannot size journal head");
+        } else {
+            // the creator may not have sized it yet
+            struct stat st {};
+            while (fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) < sizeof(journal_head_t)) {
+                if (std::chrono::steady_clock::now() >= deadline) fail("journal head exists but was never sized");
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        void* p = mmap(nullptr, sizeof(journal_head_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) fail("cannot map journal head");
+        close(fd);
+        head_ = static_cast<journal_head_t*>(p);
+
+        auto& h = head_->header;
+        if (owner) {
+            h.capacity      = options.records_per_file;
+            h.cell_size     = sizeof(record_t);
+            h.payload_size  = sizeof(Payload);
+            h.payload_align = alignof(Payload);
+            h.layout        = journal_layout_flag;
+            h.magic         = segment_magic;
+            h.version       = segment_version;
+            h.cache_line    = cache_line;
+            head_->next_seq.store(0, std::memory_order_relaxed);
+            head_->last_sync.store(now_ns(), std::memory_order_relaxed);
+            msync(head_, sizeof(journal_head_t), MS_SYNC);
+            h.state.store(segment_ready, std::memory_order_release);
+        } else {
+            while (h.state.load(std::memory_order_acquire) != segment_ready) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    munmap(head_, sizeof(journal_head_t));
+                    throw std::runtime_error(path + ": journal head was not initialized in time");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            check_field(h.magic, segment_magic, "magic");
+            check_field(h.version, segment_version, "version");
+            check_field(h.layout, journal_layout_flag, "layout");
+            check_field(h.payload_size, sizeof(Payload), "payload size");
+            check_field(h.payload_align, alignof(Payload), "payload alignment");
+            check_field(h.cell_size, sizeof(record_t), "record size");
+        }
+        per_file_ = h.capacity;
+    }
+
+    void check_field(std::size_t in_head, std::size_t expected, const char* what) {
+        if (in_head == expected) return;
+        munmap(head_, sizeof(journal_head_t));
+        throw std::runtime_error(dir_ + ": journal " + what + " mismatch, head has " + std::to_string(in_head) +
+                                 ", this handle expects " + std::to_string(expected));
+    }
+};
+
+// A consumer's position in a journal, kept in `<dir>/cursor.<name>` so that
+// it survives restarts. The file holds the first sequence number that is
+// not handled yet; everything below it is.
+//
+// With several producers, messages reach a consumer out of sequence order,
+// so commits that are ahead of a gap are held in this handle, one bit each,
+// until the gap is filled. They are not persisted, so a restart replays
+// them again. A message that never reaches this consumer (its producer died
+// between appending and publishing it) holds the cursor back until the
+// consumer restarts, resumes, and gets the message from the journal.
+class journal_cursor {
+public:
+    journal_cursor(const std::string& dir, const std::string& name) {
+        auto path = dir + "/cursor." + name;
+        int  fd   = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0) throw std::runtime_error(path + ": cannot open journal cursor");
+        struct stat st {};
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 &&
+            (static_cast<std::size_t>(st.st_size) >= sizeof(*next_) || ftruncate(fd, sizeof(*next_)) == 0))
+            p = mmap(nullptr, sizeof(*next_), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error(path + ": cannot map journal cursor");
+        next_ = static_cast<std::atomic<std::uint64_t>*>(p);
+    }
+
+    ~journal_cursor() { munmap(next_, sizeof(*next_)); }
+
+    // First sequence number not committed yet.
+    std::uint64_t next() const { return next_->load(std::memory_order_acquire); }
+
+    // Records that message `seq` has been handled. The cursor moves past it
+    // once everything before it has been handled too; it never moves back.
+    void commit(std::uint64_t seq) {
+        auto next = next_->load(std::memory_order_relaxed);
+        if (seq < next) return;                     // handled before, e.g. replayed
+        if (held_.empty()) first_word_ = next / 64;
+        auto word = seq / 64 - first_word_;
+        if (word >= held_.size()) held_.resize(word + 1, 0);
+        held_[word] |= bit(seq);
+        next_->store(advance(next), std::memory_order_release);
+    }
+
+    // Moves the cursor to `seq` if it is behind, e.g. to the sequence
+    // shm_journaled_queue::resume() returns: what was not replayed below it
+    // (torn or trimmed records) cannot be handled anymore.
+    void skip_to(std::uint64_t seq) {
+        auto next = next_->load(std::memory_order_relaxed);
+        if (seq > next) next_->store(advance(seq), std::memory_order_release);
+    }
+
+    void sync() { msync(next_, sizeof(*next_), MS_SYNC); }
+
+private:
+    std::atomic<std::uint64_t>* next_ = nullptr;
+    std::deque<std::uint64_t>   held_;           // commits ahead of next_, a bit per sequence number
+    std::uint64_t               first_word_ = 0; // seq / 64 of held_.front()
+
+    static std::uint64_t bit(std::uint64_t seq) { return std::uint64_t(1) << (seq % 64); }
+
+    // Moves past every held commit from `next` on and drops the words left
+    // behind. Returns the new position.
+    std::uint64_t advance(std::uint64_t next) {
+        while (next / 64 >= first_word_ && next / 64 - first_word_ < held_.size() &&
+               (held_[next / 64 - first_word_] & bit(next)))
+            next++;
+        while (!held_.empty() && first_word_ < next / 64) {
+            held_.pop_front();
+            first_word_++;
+        }
+        return next;
+    }
+
+    journal_cursor(journal_cursor const&) = delete;
+    void operator=(journal_cursor const&) = delete;
+};
+
+template <typename Payload>
+struct journaled_t {
+    std::uint64_t seq;
+    Payload       msg;
+};
+
+// shm_mpmc_bounded_queue whose messages are also appended to a journal.
+// Consumers get each message together with its sequence number, which is
+// what they commit to a journal_cursor.
+template <typename Payload, typename Layout = padded_cells, typename Concurrency = mpmc_t>
+class shm_journaled_queue {
+public:
+    shm_journaled_queue(const std::string& shm_name, const std::string& journal_dir,
+                        std::size_t capacity = default_queue_size, bool create_segment = true,
+                        const segment_options_t& options = {}, const journal_options_t& journal_options = {})
+        : queue_(shm_name, capacity, create_segment, options),
+          journal_(journal_dir, create_segment, journal_options) {}
+
+    shm_journal<Payload>& journal() { return journal_; }
+
+    // The cell is reserved first, so a full queue does not use up a
+    // sequence number. With several producers, ring order and sequence
+    // order differ; journal_cursor copes with that.
+    bool enqueue(const Payload& v) {
+        auto r = queue_.try_reserve();
+        if (!r) return false;
+        r->seq = journal_.append(v);
+        r->msg = v;
+        r.commit();
+        return true;
+    }
+
+    bool dequeue(Payload& out, std::uint64_t* seq = nullptr) {
+        journaled_t<Payload> m;
+        do {
+            if (!queue_.dequeue(m)) return false;
+        } while (m.seq < replayed_);
+        out = m.msg;
+        if (seq) *seq = m.seq;
+        return true;
+    }
+
+    // For a consumer restarting after the ring was lost (e.g. a reboot):
+    // replays the journal from `from`, usually cursor.next(), through
+    // fn(seq, payload). Messages replayed here that are still in the ring
+    // are dropped by dequeue() later. Returns the sequence replayed up to,
+    // which the consumer passes to journal_cursor::skip_to().
+    template <typename Fn>
+    std::uint64_t resume(std::uint64_t from, Fn&& fn) {
+        replayed_ = journal_.replay(from, std::forward<Fn>(fn));
+        return replayed_;
+    }
+
+private:
+    shm_mpmc_bounded_queue<journaled_t<Payload>, Layout, Concurrency> queue_;
+    shm_journal<Payload>                                              journal_;
+    std::uint64_t                                                     replayed_ = 0;
+};
@@ -0,0 +1,367 @@
+// Keyed MPMC queue: messages with the same key are processed in order, while
+// different keys spread over all consumers.
+//
+// Producers enqueue into one of P partitions (one Vyukov ring each) by the
+// hash of the key. A consumer only dequeues from a partition it owns, and
+// owns at most one at a time. It keeps the partition while it has messages
+// and releases it on its next dequeue once it is empty, or once it has taken
+// `burst` messages in a row so the other partitions get their turn. Since
+// the release happens in the call after the previous message was handed
+// out, a consumer that processes each message before asking for the next
+// one is done with it before any other consumer can see the next message of
+// that partition:
+//
+//     shm_keyed_queue<tick_t> q("/ticks", 64, 4096);
+//     q.enqueue(tick.instrument_id, tick);             // producer
+//     while (q.dequeue_wait(t)) process(t);            // any number of consumers
+//
+// Partitions are picked up dynamically: a consumer without a partition scans
+// for one that has messages and no owner, so idle consumers take over work
+// as soon as a busy one lets go of a partition. Keys sharing a partition
+// still wait for each other, so P should be well above the consumer count.
+//
+// A consumer that dies while owning a partition keeps it until another
+// consumer, finding nothing else to do for recovery_timeout, reaps it (or
+// reap_owners() is called). The message it was processing is lost.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t default_partition_count = 64;
+constexpr std::size_t default_burst           = 256;
+constexpr std::size_t keyed_layout_flag       = 0x8000;   // or-ed into header.layout
+
+}
+
+// Entry of the consumer table. Partition owners are named by their index
+// in this table plus one.
+struct alignas(cache_line) keyed_consumer_t {
+    std::atomic<std::int32_t>  pid;                 // 0 = free, -pid while registering
+    std::atomic<std::uint64_t> start_time;          // see process_start_time()
+};
+
+// Ownership word of a partition, on its own line.
+struct alignas(cache_line) partition_owner_t {
+    std::atomic<std::uint32_t> owner;               // 0 = free, consumer slot + 1 otherwise
+};
+
+// Control block at the start of a keyed segment, followed by the consumer
+// table, the owner table and the partition rings.
+struct keyed_data_t {
+    segment_header_t header;        // describes a single partition
+    std::size_t partitions;
+    std::size_t partition_bytes;    // stride between rings
+    std::size_t consumer_slots;
+
+    // Futex words shared by all partitions, see queue_data_t. not_empty is
+    // also bumped when a consumer lets go of a partition that still has
+    // messages, so that idle consumers pick it up. Producers wait for room
+    // in the partition their key hashes to, so they sleep on that
+    // partition's own not_full word.
+    alignas(cache_line)
+    std::atomic<std::uint32_t> not_empty;
+    std::atomic<std::uint32_t> consumers_waiting;
+
+    keyed_consumer_t* consumers() {
+        return reinterpret_cast<keyed_consumer_t*>(reinterpret_cast<char*>(this) + sizeof(keyed_data_t));
+    }
+
+    partition_owner_t* owners() {
+        return reinterpret_cast<partition_owner_t*>(consumers() + consumer_slots);
+    }
+
+    queue_data_t* partition(std::size_t i) {
+        return reinterpret_cast<queue_data_t*>(reinterpret_cast<char*>(owners() + partitions) + i * partition_bytes);
+    }
+};
+
+template <typename Payload, typename Layout = padded_cells>
+class shm_keyed_queue {
+    using cells_t = typename Layout::template cells<Payload>;
+    using ring_t  = ring_ops<Payload, Layout>;
+
+public:
+    // `partitions` and `partition_capacity` are only used by the creator;
+    // attachers take them from the segment header. options.handle_slots
+    // bounds the number of consumer handles.
+    explicit shm_keyed_queue(const std::string& shm_name,
+                             std::size_t partitions = default_partition_count,
+                             std::size_t partition_capacity = default_queue_size / default_partition_count,
+                             bool create_segment = true,
+                             const segment_options_t& options = {})
+        : segment_(shm_name, create_segment,
+                   checked_segment_size(partitions, partition_capacity, options.handle_slots), options),
+          data_(static_cast<keyed_data_t*>(segment_.data())),
+          recovery_timeout_(options.recovery_timeout)
+    {
+        if (segment_.created()) {
+            init(partitions, partition_capacity, options.handle_slots);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, Layout::id | keyed_layout_flag, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, cells_t::stride, "cell size");
+            segment_.check_field(data_->partition_bytes, ring_t::block_bytes(h.capacity), "partition size");
+            if (data_->partitions == 0 ||
+                segment_size(data_->partitions, h.capacity, data_->consumer_slots) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        partitions_ = data_->partitions;
+        owned_      = partitions_;
+    }
+
+    ~shm_keyed_queue() {
+        if (!self_) return;
+        release();
+        self_->pid.store(0, std::memory_order_release);
+    }
+
+    std::size_t partitions()         const { return partitions_; }
+    std::size_t partition_capacity() const { return data_->header.capacity; }
+
+    // Partition this handle currently owns, or partitions() if none.
+    std::size_t owned_partition() const { return owned_; }
+
+    // Messages a consumer takes from one partition before it gives the
+    // others a turn.
+    void set_burst(std::size_t burst) { burst_ = burst ? burst : 1; }
+
+    static std::size_t segment_size(std::size_t partitions, std::size_t partition_capacity,
+                                    std::size_t consumer_slots) {
+        return sizeof(keyed_data_t) + consumer_slots * sizeof(keyed_consumer_t) +
+               partitions * (sizeof(partition_owner_t) + ring_t::block_bytes(partition_capacity));
+    }
+
+    // Partition that messages with `key` go to.
+    template <typename Key>
+    std::size_t partition_of(const Key& key) const {
+        return std::hash<Key>{}(key) % partitions_;
+    }
+
+    // Returns false if the key's partition is full.
+    template <typename Key>
+    bool enqueue(const Key& key, const Payload& v) {
+        if (!ring_t::push(data_->partition(partition_of(key)), v)) return false;
+        notify_waiters(data_->not_empty, data_->consumers_waiting, 1);
+        return true;
+    }
+
+    template <typename Key>
+    bool enqueue_wait(const Key& key, const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        auto* q = data_->partition(partition_of(key));
+        return waiter_.wait_until([&] { return enqueue(key, v); },
+                                  q->not_full, q->producers_waiting, timeout);
+    }
+
+    // Dequeues the next message of the owned partition, or takes over
+    // another one. Returns false if no unowned partition has messages. If
+    // `partition` is given, it receives the partition the message came from.
+    bool dequeue(Payload& out, std::size_t* partition = nullptr) {
+        return dequeue_bulk(&out, 1, partition) != 0;
+    }
+
+    // Dequeues up to `n` messages, all from the same partition and in order.
+    std::size_t dequeue_bulk(Payload* out, std::size_t n, std::size_t* partition = nullptr) {
+        if (!self_) register_consumer();
+        if (owned_ == partitions_ || taken_ >= burst_ || !take(out, n))
+            if (!switch_partition(out, n)) return 0;
+        if (partition) *partition = owned_;
+        auto* q = data_->partition(owned_);
+        notify_waiters(q->not_full, q->producers_waiting, got_);
+        return got_;
+    }
+
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout, std::size_t* partition = nullptr) {
+        return waiter_.wait_until([&] { return dequeue(out, partition); },
+                                  data_->not_empty, data_->consumers_waiting, timeout);
+    }
+
+    // Lets go of the owned partition. Call it after the last message has
+    // been processed before a consumer stops dequeuing for a while; it is
+    // done implicitly by dequeue() and on destruction.
+    void release() {
+        if (owned_ == partitions_) return;
+        auto* q = data_->partition(owned_);
+        data_->owners()[owned_].owner.store(0, std::memory_order_release);
+        owned_ = partitions_;
+        taken_ = 0;
+        if (pending(q))
+            notify_waiters(data_->not_empty, data_->consumers_waiting, 1);
+    }
+
+    // Frees the partitions of consumers whose process has exited. Consumers
+    // call this on their own once every partition with messages has stayed
+    // owned for recovery_timeout; a supervisor may call it at any time.
+    // Returns the number of partitions freed.
+    std::size_t reap_owners() {
+        std::size_t n = 0;
+        auto* table = data_->consumers();
+        for (std::size_t c = 0; c < data_->consumer_slots; c++) {
+            auto& e   = table[c];
+            auto  pid = e.pid.load(std::memory_order_acquire);
+            bool  dead = pid < 0 ? kill(-pid, 0) != 0 && errno == ESRCH
+                                 : pid > 0 && !process_alive(pid, e.start_time.load(std::memory_order_relaxed));
+            if (!dead) continue;
+            for (std::size_t p = 0; p < partitions_; p++) {
+                auto id = static_cast<std::uint32_t>(c + 1);
+                n += data_->owners()[p].owner.compare_exchange_strong(id, 0, std::memory_order_acq_rel);
+            }
+            e.pid.compare_exchange_strong(pid, 0, std::memory_order_release);
+        }
+        if (n) notify_waiters(data_->not_empty, data_->consumers_waiting, n);
+        return n;
+    }
+
+private:
+    shm_segment       segment_;
+    keyed_data_t*     data_;
+    std::size_t       partitions_ = 0;
+    keyed_consumer_t* self_       = nullptr;    // registered on the first dequeue
+    std::uint32_t     id_         = 0;          // owner id of this handle
+    std::size_t       owned_      = 0;          // partitions_ if none
+    std::size_t       taken_      = 0;          // messages taken from owned_ in a row
+    std::size_t       got_        = 0;          // result of the last take()
+    std::size_t       next_scan_  = 0;          // where the next search for a partition starts
+    std::size_t       burst_      = default_burst;
+    adaptive_waiter   waiter_;
+
+    // Recovery of partitions held by dead consumers.
+    std::chrono::nanoseconds              recovery_timeout_;
+    bool                                  starved_ = false;
+    std::chrono::steady_clock::time_point starved_since_;
+
+    shm_keyed_queue(shm_keyed_queue const&) = delete;
+    void operator=(shm_keyed_queue const&) = delete;
+
+    // Whether the ring has claimed cells left, published or not.
+    static bool pending(queue_data_t* q) {
+        return q->enqueue_pos.load(std::memory_order_acquire) > q->dequeue_pos.load(std::memory_order_relaxed);
+    }
+
+    // Pops up to `n` messages of the owned partition.
+    bool take(Payload* out, std::size_t n) {
+        auto* q = data_->partition(owned_);
+        std::size_t k = 0;
+        while (k < n && taken_ < burst_ && ring_t::pop(q, out[k])) {
+            k++;
+            taken_++;
+        }
+        got_ = k;
+        return k != 0;
+    }
+
+    // Releases the owned partition and takes the next unowned one with
+    // messages, starting after the last one taken. The released partition
+    // comes last, so it is taken again only if nobody else needs a turn.
+    bool switch_partition(Payload* out, std::size_t n) {
+        release();
+        bool busy = false;                      // some partition has messages but is owned
+        for (std::size_t i = 0; i < partitions_; i++) {
+            auto  p = (next_scan_ + i) % partitions_;
+            auto* q = data_->partition(p);
+            if (!pending(q)) continue;
+
+            auto& owner = data_->owners()[p].owner;
+            std::uint32_t expected = 0;
+            if (owner.load(std::memory_order_relaxed) != 0 ||
+                !owner.compare_exchange_strong(expected, id_, std::memory_order_acquire)) {
+                busy = true;
+                continue;
+            }
+            owned_     = p;
+            next_scan_ = p + 1;
+            if (take(out, n)) {
+                starved_ = false;
+                return true;
+            }
+            release();                          // the claimed cell is not published yet
+        }
+        on_starved(busy);
+        return false;
+    }
+
+    // Called when no partition could be taken. If messages wait in owned
+    // partitions for recovery_timeout, their owners may be dead.
+    void on_starved(bool busy) {
+        if (!busy) {
+            starved_ = false;
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (!starved_) {
+            starved_       = true;
+            starved_since_ = now;
+        } else if (now - starved_since_ >= recovery_timeout_) {
+            reap_owners();
+            starved_since_ = now;
+        }
+    }
+
+    void register_consumer() {
+        auto* table = data_->consumers();
+        auto  pid   = static_cast<std::int32_t>(getpid());
+        auto  start = process_start_time(pid);
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (std::size_t i = 0; i < data_->consumer_slots; i++) {
+                std::int32_t expected = 0;
+                auto& e = table[i];
+                if (!e.pid.compare_exchange_strong(expected, -pid, std::memory_order_acquire))
+                    continue;
+                e.start_time.store(start, std::memory_order_relaxed);
+                e.pid.store(pid, std::memory_order_release);
+                self_      = &e;
+                id_        = static_cast<std::uint32_t>(i + 1);
+                next_scan_ = i * partitions_ / data_->consumer_slots;   // spread the first scans
+                return;
+            }
+            reap_owners();
+        }
+        throw std::runtime_error("consumer table is full");
+    }
+
+    void init(std::size_t partitions, std::size_t partition_capacity, std::size_t consumer_slots) {
+        auto* d = data_;
+        d->header.capacity      = partition_capacity;
+        d->header.cell_size     = cells_t::stride;
+        d->header.payload_size  = sizeof(Payload);
+        d->header.payload_align = alignof(Payload);
+        d->header.layout        = Layout::id | keyed_layout_flag;
+        d->partitions      = partitions;
+        d->partition_bytes = ring_t::block_bytes(partition_capacity);
+        d->consumer_slots  = consumer_slots;
+        d->not_empty.store(0, std::memory_order_relaxed);
+        d->consumers_waiting.store(0, std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < consumer_slots; i++)
+            new (&d->consumers()[i]) keyed_consumer_t{};
+        for (std::size_t i = 0; i < partitions; i++) {
+            new (&d->owners()[i]) partition_owner_t{};
+            init_queue<Payload, Layout>(d->partition(i), partition_capacity);
+        }
+    }
+
+    static std::size_t checked_segment_size(std::size_t partitions, std::size_t partition_capacity,
+                                            std::size_t consumer_slots) {
+        if (partitions == 0)
+            throw std::invalid_argument("a keyed queue needs at least one partition");
+        if (partition_capacity < 2 || (partition_capacity & (partition_capacity - 1)) != 0)
+            throw std::invalid_argument("partition capacity must be a power of 2");
+        if (consumer_slots == 0)
+            throw std::invalid_argument("a keyed queue needs at least one consumer slot");
+        return segment_size(partitions, partition_capacity, consumer_slots);
+    }
+};
@@ -1,163 +1,1244 @@
 // Based on Dmitry Vyukov's MPMC Queue
 
+#pragma once
+
 #include <atomic>
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <stdexcept>
 #include <string>
 #include <new>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>   
-#include <unistd.h>  
-#include <new>
+#include <utility>
+#include <vector>
+#include "ipc_shm.h"
 
 namespace {
 
 constexpr std::size_t default_queue_size = 1048576; // must be a power of 2
 
-template <typename Payload>
+// Set in a cell's seq when the producer gave up its reservation; the rest of
+// the value is the usual "ready for consumer" sequence.
+constexpr std::size_t seq_abandoned = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+
+constexpr std::size_t cache_line = std::hardware_destructive_interference_size;
+
+constexpr std::size_t floor_pow2(std::size_t n) {
+    std::size_t p = 1;
+    while (p * 2 <= n) p *= 2;
+    return p;
+}
+
+}
+
+// Cell layouts, selected with the second template argument of
+// shm_mpmc_bounded_queue. Each one tells the queue how many bytes `capacity`
+// cells take and where the sequence word and payload of cell `i` live.
+
+// One cell per cache line: no false sharing between neighbouring cells, at the
+// price of padding small payloads up to a full line.
+struct padded_cells {
+    static constexpr std::size_t id = 1;
+
+    template <typename Payload>
+    struct cells {
+        struct alignas(cache_line) cell {
+            std::atomic<std::size_t> seq;
+            Payload data;
+
+            char pad[
+                cache_line > sizeof(std::atomic<std::size_t>) + sizeof(Payload)
+                ? cache_line - sizeof(std::atomic<std::size_t>) - sizeof(Payload)
+                : 0
+            ];
+        };
+
+        static constexpr std::size_t stride   = sizeof(cell);
+        static constexpr std::size_t per_line = 1;
+
+        static std::size_t bytes(std::size_t capacity) { return capacity * sizeof(cell); }
+
+        static std::atomic<std::size_t>& seq(char* base, std::size_t, std::size_t i) {
+            return reinterpret_cast<cell*>(base)[i].seq;
+        }
+        static Payload& data(char* base, std::size_t, std::size_t i) {
+            return reinterpret_cast<cell*>(base)[i].data;
+        }
+    };
+};
+
+// Sequence word and payload back to back with natural alignment, so several
+// small cells share a line.
+struct packed_cells {
+    static constexpr std::size_t id = 2;
+
+    template <typename Payload>
+    struct cells {
+        struct cell {
+            std::atomic<std::size_t> seq;
+            Payload data;
+        };
+
+        static constexpr std::size_t stride   = sizeof(cell);
+        static constexpr std::size_t per_line = floor_pow2(cache_line / sizeof(cell) ? cache_line / sizeof(cell) : 1);
+
+        static std::size_t bytes(std::size_t capacity) { return capacity * sizeof(cell); }
+
+        static std::atomic<std::size_t>& seq(char* base, std::size_t, std::size_t i) {
+            return reinterpret_cast<cell*>(base)[i].seq;
+        }
+        static Payload& data(char* base, std::size_t, std::size_t i) {
+            return reinterpret_cast<cell*>(base)[i].data;
+        }
+    };
+};
+
+// All sequence words first, then all payloads. The array scanned by the claim
+// loops stays dense, and payload lines are only touched by the owner of a cell.
+struct split_cells {
+    static constexpr std::size_t id = 3;
+
+    template <typename Payload>
+    struct cells {
+        static_assert(alignof(Payload) <= cache_line, "over-aligned payloads are not supported");
+
+        static constexpr std::size_t stride   = sizeof(Payload);
+        static constexpr std::size_t per_line = cache_line / sizeof(std::atomic<std::size_t>);
+
+        static std::size_t seq_bytes(std::size_t capacity) {
+            return (capacity * sizeof(std::atomic<std::size_t>) + cache_line - 1) & ~(cache_line - 1);
+        }
+
+        static std::size_t bytes(std::size_t capacity) {
+            return seq_bytes(capacity) + capacity * sizeof(Payload);
+        }
+
+        static std::atomic<std::size_t>& seq(char* base, std::size_t, std::size_t i) {
+            return reinterpret_cast<std::atomic<std::size_t>*>(base)[i];
+        }
+        static Payload& data(char* base, std::size_t capacity, std::size_t i) {
+            return reinterpret_cast<Payload*>(base + seq_bytes(capacity))[i];
+        }
+    };
+};
+
+// Wraps a dense layout so that consecutive positions land on different cache
+// lines: the low bits of the index (position within a line) become the high
+// bits, spreading neighbouring producers and consumers across the ring.
+template <typename Layout>
+struct scrambled {
+    static constexpr std::size_t id = Layout::id | 0x100;
+
+    template <typename Payload>
+    struct cells : Layout::template cells<Payload> {
+        using inner = typename Layout::template cells<Payload>;
+
+        static std::size_t remap(std::size_t capacity, std::size_t i) {
+            constexpr std::size_t k    = inner::per_line;
+            constexpr int         bits = __builtin_ctzll(k);
+            if (k == 1 || capacity <= k) return i;
+            int shift = __builtin_ctzll(capacity) - bits;
+            return ((i & (k - 1)) << shift) | (i >> bits);
+        }
+
+        static std::atomic<std::size_t>& seq(char* base, std::size_t capacity, std::size_t i) {
+            return inner::seq(base, capacity, remap(capacity, i));
+        }
+        static Payload& data(char* base, std::size_t capacity, std::size_t i) {
+            return inner::data(base, capacity, remap(capacity, i));
+        }
+    };
+};
+
+// Concurrency tags, the third template argument of shm_mpmc_bounded_queue.
+// All four use the same segment format; a single-sided end just skips the CAS
+// on its index, so a handle must only use a single-* tag if it really is the
+// only producer (or consumer) of the queue.
+template <bool MultiProducer, bool MultiConsumer>
+struct concurrency_t {
+    static constexpr bool multi_producer = MultiProducer;
+    static constexpr bool multi_consumer = MultiConsumer;
+};
+
+using spsc_t = concurrency_t<false, false>;
+using mpsc_t = concurrency_t<true,  false>;
+using spmc_t = concurrency_t<false, true>;
+using mpmc_t = concurrency_t<true,  true>;
+
+// Entry of the producer table of a robust queue. A producer announces the
+// positions it is about to claim before it claims them and withdraws the
+// announcement once they are published, so after a crash the table tells
+// which cells the dead process left unpublished.
+struct alignas(cache_line) producer_entry_t {
+    std::atomic<std::int32_t>  pid;                 // 0 = free, -pid while registering
+    std::atomic<std::uint64_t> start_time;          // see process_start_time()
+    std::atomic<std::size_t>   pending_pos;
+    std::atomic<std::size_t>   pending_count;       // 0 = nothing in flight
+};
+
+// Per-handle counters, see segment_options_t::metrics_slots. Each handle owns
+// one line and is the only writer of its counters; slot 0 accumulates the
+// counters of handles that have been closed or whose process died.
+struct alignas(cache_line) queue_metrics_t {
+    std::atomic<std::int32_t>  pid;                 // 0 = free, -pid while registering or being reaped
+    std::atomic<std::uint32_t> start_time;          // low bits of process_start_time(), to stay in one line
+    std::atomic<std::uint64_t> enqueued;
+    std::atomic<std::uint64_t> dequeued;
+    std::atomic<std::uint64_t> full;                // enqueue attempts that found the queue full
+    std::atomic<std::uint64_t> empty;               // dequeue attempts that found it empty
+    std::atomic<std::uint64_t> enqueue_retries;     // lost CASes / stale positions in the claim loops
+    std::atomic<std::uint64_t> dequeue_retries;
+    std::atomic<std::uint64_t> max_depth;           // deepest queue seen by an enqueue
+};
+
+// Entry of the listener table, see shm_mpmc_bounded_queue::notify_fd(). A
+// listener owns a FIFO named after the queue and the slot; producers write a
+// byte to it when they publish into a queue the listener has found empty.
+struct alignas(cache_line) listener_entry_t {
+    std::atomic<std::int32_t>  pid;                 // 0 = free, -pid while registering
+    std::atomic<std::uint64_t> start_time;          // see process_start_time()
+    std::atomic<std::uint32_t> armed;               // 1 while the owner waits for a message
+    std::atomic<std::uint32_t> generation;          // bumped whenever the FIFO is recreated
+};
+
+// Control block at the start of every queue segment; the cells follow it,
+// then the optional producer, metrics and listener tables.
 struct queue_data_t {
-    alignas(std::hardware_destructive_interference_size)
+    segment_header_t header;
+    std::size_t mask;
+    std::size_t producer_slots;                 // entries in the producer table, 0 if not robust
+    std::size_t metrics_slots;                  // entries in the metrics table, 0 if disabled
+    std::size_t metrics_offset;                 // of the metrics table, from the start of this struct
+    std::size_t listener_slots;                 // entries in the listener table, 0 if disabled
+    std::size_t listener_offset;                // of the listener table, from the start of this struct
+
+    alignas(cache_line)
     std::atomic<std::size_t> enqueue_pos;
 
-    char pad1[std::hardware_destructive_interference_size - sizeof(std::atomic<std::size_t>)];
+    char pad1[cache_line - sizeof(std::atomic<std::size_t>)];
 
-    alignas(std::hardware_destructive_interference_size)
+    alignas(cache_line)
     std::atomic<std::size_t> dequeue_pos;
 
-    char pad2[std::hardware_destructive_interference_size - sizeof(std::atomic<std::size_t>)];
-
-    std::size_t mask;
+    char pad2[cache_line - sizeof(std::atomic<std::size_t>)];
 
-    struct alignas(std::hardware_destructive_interference_size) cell {
-        std::atomic<std::size_t> seq;
-        Payload data;
+    // Futex words for the blocking calls. The words are only bumped (and
+    // FUTEX_WAKE only issued) when the matching waiter counter is non-zero,
+    // so this line stays read-only while nobody is parked.
+    alignas(cache_line)
+    std::atomic<std::uint32_t> not_empty;
+    std::atomic<std::uint32_t> consumers_waiting;
+    std::atomic<std::uint32_t> not_full;
+    std::atomic<std::uint32_t> producers_waiting;
+    std::atomic<std::uint32_t> listeners_armed;   // listeners waiting for a message
 
-        char pad[
-            std::hardware_destructive_interference_size >
-            sizeof(std::atomic<std::size_t>) + sizeof(Payload)
-            ? std::hardware_destructive_interference_size - sizeof(std::atomic<std::size_t>) - sizeof(Payload)
-            : 0
-        ];
-    };
+    std::atomic<std::size_t> abandoned;         // reservations skipped by consumers
+    std::atomic<std::size_t> recovered;         // cells of dead producers poisoned by recover()
 
-    alignas(std::hardware_destructive_interference_size)
-    cell buf[default_queue_size];
+    // header.capacity cells follow right after this struct in the segment
+    char* cells() {
+        return reinterpret_cast<char*>(this) + sizeof(queue_data_t);
+    }
 };
 
+// The producer table of a robust queue follows the cells, on its own line.
+inline std::size_t producer_table_offset(std::size_t cell_bytes) {
+    return (cell_bytes + cache_line - 1) & ~(cache_line - 1);
 }
 
-template <typename Payload>
-inline void init_queue(queue_data_t<Payload>* q) {
+inline std::size_t metrics_table_offset(std::size_t cell_bytes, std::size_t producer_slots) {
+    return sizeof(queue_data_t) + producer_table_offset(cell_bytes) + producer_slots * sizeof(producer_entry_t);
+}
+
+inline queue_metrics_t* metrics_table(queue_data_t* q) {
+    return reinterpret_cast<queue_metrics_t*>(reinterpret_cast<char*>(q) + q->metrics_offset);
+}
+
+inline listener_entry_t* listener_table(queue_data_t* q) {
+    return reinterpret_cast<listener_entry_t*>(reinterpret_cast<char*>(q) + q->listener_offset);
+}
+
+template <typename Payload, typename Layout = padded_cells>
+inline void init_queue(queue_data_t* q, std::size_t capacity, std::size_t producer_slots = 0,
+                       std::size_t metrics_slots = 0, std::size_t listener_slots = 0) {
+    using cells_t = typename Layout::template cells<Payload>;
+
+    q->header.capacity      = capacity;
+    q->header.cell_size     = cells_t::stride;
+    q->header.payload_size  = sizeof(Payload);
+    q->header.payload_align = alignof(Payload);
+    q->header.layout        = Layout::id;
+    q->mask = capacity - 1;
+    q->producer_slots = producer_slots;
+    q->metrics_slots  = metrics_slots;
+    q->metrics_offset = metrics_table_offset(cells_t::bytes(capacity), producer_slots);
+    q->listener_slots  = listener_slots;
+    q->listener_offset = q->metrics_offset + metrics_slots * sizeof(queue_metrics_t);
     q->enqueue_pos.store(0, std::memory_order_relaxed);
     q->dequeue_pos.store(0, std::memory_order_relaxed);
-    q->mask = default_queue_size - 1;
+    q->not_empty.store(0, std::memory_order_relaxed);
+    q->consumers_waiting.store(0, std::memory_order_relaxed);
+    q->not_full.store(0, std::memory_order_relaxed);
+    q->producers_waiting.store(0, std::memory_order_relaxed);
+    q->listeners_armed.store(0, std::memory_order_relaxed);
+    q->abandoned.store(0, std::memory_order_relaxed);
+    q->recovered.store(0, std::memory_order_relaxed);
 
-    for (std::size_t i = 0; i < default_queue_size; i++) {
-        q->buf[i].seq.store(i, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < capacity; i++) {
+        cells_t::seq(q->cells(), capacity, i).store(i, std::memory_order_relaxed);
     }
+
+    auto* table = reinterpret_cast<producer_entry_t*>(q->cells() + producer_table_offset(cells_t::bytes(capacity)));
+    for (std::size_t i = 0; i < producer_slots; i++)
+        new (&table[i]) producer_entry_t{};
+
+    for (std::size_t i = 0; i < metrics_slots; i++)
+        new (&metrics_table(q)[i]) queue_metrics_t{};
+    if (metrics_slots)
+        metrics_table(q)[0].pid.store(-1, std::memory_order_relaxed);   // reserved for closed handles
+
+    for (std::size_t i = 0; i < listener_slots; i++)
+        new (&listener_table(q)[i]) listener_entry_t{};
 }
 
-template<typename Payload>
+// Plain Vyukov enqueue/dequeue on a ring embedded in a larger segment, for
+// containers built out of several rings (shm_sharded_queue, shm_priority_queue).
+// The ring must have been set up with init_queue<Payload, Layout>.
+template <typename Payload, typename Layout = padded_cells>
+struct ring_ops {
+    using cells_t = typename Layout::template cells<Payload>;
+
+    // Bytes one ring takes, rounded up so that the next one starts on a line.
+    static std::size_t block_bytes(std::size_t capacity) {
+        return (sizeof(queue_data_t) + cells_t::bytes(capacity) + cache_line - 1) & ~(cache_line - 1);
+    }
+
+    static bool push(queue_data_t* q, const Payload& v) {
+        auto pos = q->enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& seq = seq_at(q, pos);
+            auto  dif = static_cast<std::intptr_t>(seq.load(std::memory_order_acquire)) -
+                        static_cast<std::intptr_t>(pos);
+            if (dif == 0) {
+                if (q->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    data_at(q, pos) = v;
+                    seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;                          // full
+            } else {
+                pos = q->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    static bool pop(queue_data_t* q, Payload& out) {
+        auto pos = q->dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& seq = seq_at(q, pos);
+            auto  dif = static_cast<std::intptr_t>(seq.load(std::memory_order_acquire)) -
+                        static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0) {
+                if (q->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = data_at(q, pos);
+                    seq.store(pos + q->mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;                          // empty
+            } else {
+                pos = q->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Bulk variants, see shm_mpmc_bounded_queue::enqueue_bulk/dequeue_bulk:
+    // take the run of up to `n` consecutive ready cells with one CAS.
+    // Return how many messages were moved, 0 if full/empty.
+    static std::size_t push_bulk(queue_data_t* q, const Payload* items, std::size_t n) {
+        if (n == 0) return 0;
+        auto pos = q->enqueue_pos.load(std::memory_order_relaxed);
+        std::size_t k;
+        for (;;) {
+            auto dif = static_cast<std::intptr_t>(seq_at(q, pos).load(std::memory_order_acquire)) -
+                       static_cast<std::intptr_t>(pos);
+            if (dif == 0) {
+                for (k = 1; k < n && seq_at(q, pos + k).load(std::memory_order_acquire) == pos + k; k++) {}
+                if (q->enqueue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return 0;                              // full
+            } else {
+                pos = q->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        for (std::size_t i = 0; i < k; i++) {
+            data_at(q, pos + i) = items[i];
+            seq_at(q, pos + i).store(pos + i + 1, std::memory_order_release);
+        }
+        return k;
+    }
+
+    static std::size_t pop_bulk(queue_data_t* q, Payload* out, std::size_t n) {
+        if (n == 0) return 0;
+        auto pos = q->dequeue_pos.load(std::memory_order_relaxed);
+        std::size_t k;
+        for (;;) {
+            auto dif = static_cast<std::intptr_t>(seq_at(q, pos).load(std::memory_order_acquire)) -
+                       static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0) {
+                for (k = 1; k < n && seq_at(q, pos + k).load(std::memory_order_acquire) == pos + k + 1; k++) {}
+                if (q->dequeue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return 0;                              // empty
+            } else {
+                pos = q->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        for (std::size_t i = 0; i < k; i++) {
+            out[i] = data_at(q, pos + i);
+            seq_at(q, pos + i).store(pos + i + q->mask + 1, std::memory_order_release);
+        }
+        return k;
+    }
+
+    static std::atomic<std::size_t>& seq_at(queue_data_t* q, std::size_t pos) {
+        return cells_t::seq(q->cells(), q->mask + 1, pos & q->mask);
+    }
+
+    static Payload& data_at(queue_data_t* q, std::size_t pos) {
+        return cells_t::data(q->cells(), q->mask + 1, pos & q->mask);
+    }
+};
+
+template <typename Payload, typename Layout = padded_cells, typename Concurrency = mpmc_t>
 class shm_mpmc_bounded_queue {
+    using cells_t = typename Layout::template cells<Payload>;
+    using seq_t   = std::atomic<std::size_t>;
+
 public:
-    explicit shm_mpmc_bounded_queue(const std::string& shm_name, bool create_segment=true)
-        : shm_name_(shm_name), fd_(-1), data_(nullptr), owner_(false)
+    // `capacity` is only used when this handle creates the segment; attachers
+    // take it from the segment header.
+    explicit shm_mpmc_bounded_queue(const std::string& shm_name,
+                                    std::size_t capacity = default_queue_size,
+                                    bool create_segment = true,
+                                    const segment_options_t& options = {})
+        : segment_(shm_name, create_segment,
+                   checked_segment_size(capacity, options.robust_producers, options.metrics_slots,
+                                        options.listener_slots), options),
+          data_(static_cast<queue_data_t*>(segment_.data())),
+          recovery_timeout_(options.recovery_timeout),
+          notify_dir_(options.notify_dir)
     {
-        open_segment(create_segment);
+        if (segment_.created()) {
+            init_queue<Payload, Layout>(data_, capacity, options.robust_producers, options.metrics_slots,
+                                        options.listener_slots);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, Layout::id, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, cells_t::stride, "cell size");
+            if (segment_size(h.capacity, data_->producer_slots, data_->metrics_slots,
+                             data_->listener_slots) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        cells_    = data_->cells();
+        capacity_ = data_->header.capacity;
+        if (data_->producer_slots)
+            register_producer();
+#ifdef IPC_MPMC_METRICS
+        if (data_->metrics_slots)
+            register_metrics();
+#endif
+        if (data_->listener_slots) {
+            listeners_ = listener_table(data_);
+            signal_fds_.assign(data_->listener_slots, { -1, 0 });
+        }
     }
 
     ~shm_mpmc_bounded_queue() {
-        if (data_) munmap(data_, sizeof(queue_data_t<Payload>));
-        if (fd_ >= 0) close(fd_);
-        if (owner_) shm_unlink(shm_name_.c_str());
+        if (self_) self_->pid.store(0, std::memory_order_release);
+        if (listening_) unregister_listener();
+        for (auto& s : signal_fds_)
+            if (s.first >= 0) close(s.first);
+#ifdef IPC_MPMC_METRICS
+        if (metrics_) retire_metrics();
+#endif
     }
 
+    std::size_t capacity() const { return capacity_; }
+
+    static std::size_t segment_size(std::size_t capacity, std::size_t producer_slots = 0,
+                                    std::size_t metrics_slots = 0, std::size_t listener_slots = 0) {
+        if (producer_slots == 0 && metrics_slots == 0 && listener_slots == 0)
+            return sizeof(queue_data_t) + cells_t::bytes(capacity);
+        return metrics_table_offset(cells_t::bytes(capacity), producer_slots) +
+               metrics_slots * sizeof(queue_metrics_t) + listener_slots * sizeof(listener_entry_t);
+    }
+
+    // In-place write into a claimed cell. Dropping a reservation without
+    // commit() publishes the cell as abandoned: consumers skip it and bump
+    // abandoned_count() instead of stalling behind it.
+    class reservation {
+    public:
+        reservation() = default;
+        reservation(reservation&& o) noexcept { *this = std::move(o); }
+        reservation& operator=(reservation&& o) noexcept {
+            if (this != &o) {
+                abandon();
+                queue_ = o.queue_; seq_ = o.seq_; data_ = o.data_; pos_ = o.pos_; owner_ = o.owner_;
+                o.seq_ = nullptr;
+            }
+            return *this;
+        }
+        ~reservation() { abandon(); }
+
+        explicit operator bool() const { return seq_ != nullptr; }
+        Payload& operator*()  const { return *data_; }
+        Payload* operator->() const { return data_; }
+
+        void commit() {
+            seq_->store(pos_ + 1, std::memory_order_release);
+            if (owner_) owner_->pending_count.store(0, std::memory_order_release);
+            queue_->published(1);
+            seq_ = nullptr;
+        }
+
+    private:
+        friend class shm_mpmc_bounded_queue;
+        reservation(shm_mpmc_bounded_queue* queue, seq_t* seq, Payload* data, std::size_t pos,
+                    producer_entry_t* owner)
+            : queue_(queue), seq_(seq), data_(data), pos_(pos), owner_(owner) {}
+
+        void abandon() {
+            if (!seq_) return;
+            seq_->store((pos_ + 1) | seq_abandoned, std::memory_order_release);
+            if (owner_) owner_->pending_count.store(0, std::memory_order_release);
+            queue_->published(1);
+            seq_ = nullptr;
+        }
+
+        shm_mpmc_bounded_queue* queue_ = nullptr;
+        seq_t*            seq_   = nullptr;
+        Payload*          data_  = nullptr;
+        std::size_t       pos_   = 0;
+        producer_entry_t* owner_ = nullptr;
+    };
+
+    // In-place read of a claimed cell. The cell goes back to the producers on
+    // release() or when the handle is dropped.
+    class peeked {
+    public:
+        peeked() = default;
+        peeked(peeked&& o) noexcept { *this = std::move(o); }
+        peeked& operator=(peeked&& o) noexcept {
+            if (this != &o) {
+                release();
+                q_ = o.q_; seq_ = o.seq_; data_ = o.data_; pos_ = o.pos_;
+                o.seq_ = nullptr;
+            }
+            return *this;
+        }
+        ~peeked() { release(); }
+
+        explicit operator bool() const { return seq_ != nullptr; }
+        const Payload& operator*()  const { return *data_; }
+        const Payload* operator->() const { return data_; }
+
+        void release() {
+            if (!seq_) return;
+            seq_->store(pos_ + q_->mask + 1, std::memory_order_release);
+            notify_waiters(q_->not_full, q_->producers_waiting, 1);
+            seq_ = nullptr;
+        }
+
+    private:
+        friend class shm_mpmc_bounded_queue;
+        peeked(queue_data_t* q, seq_t* seq, Payload* data, std::size_t pos)
+            : q_(q), seq_(seq), data_(data), pos_(pos) {}
+
+        queue_data_t* q_    = nullptr;
+        seq_t*        seq_  = nullptr;
+        Payload*      data_ = nullptr;
+        std::size_t   pos_  = 0;
+    };
+
     bool enqueue(const Payload& v) {
-        auto* q   = data_;
-        auto  pos = q->enqueue_pos.load(std::memory_order_relaxed);
-        cell_t* c;
+        auto pos = data_->enqueue_pos.load(std::memory_order_relaxed);
+        if (!claim_for_write(pos)) {
+            count(&queue_metrics_t::full);
+            return false;                              // full
+        }
+
+        data_at(pos) = v;
+        seq_at(pos).store(pos + 1, std::memory_order_release);
+        settle();
+        count_enqueued(pos, 1);
+        published(1);
+        return true;
+    }
+
+    bool dequeue(Payload& out) {
+        auto pos = data_->dequeue_pos.load(std::memory_order_relaxed);
+        if (!claim_for_read(pos)) {
+            on_empty(pos);
+            count(&queue_metrics_t::empty);
+            return false;                              // empty
+        }
+
+        out = data_at(pos);
+        seq_at(pos).store(pos + capacity_, std::memory_order_release);
+        count(&queue_metrics_t::dequeued);
+        notify_waiters(data_->not_full, data_->producers_waiting, 1);
+        return true;
+    }
+
+    // Zero-copy variants of enqueue()/dequeue(). Both return an empty handle
+    // when the queue is full/empty.
+    // A robust queue tracks one claim per handle, so there a handle can hold
+    // only one reservation at a time.
+    reservation try_reserve() {
+        if (self_ && self_->pending_count.load(std::memory_order_relaxed) != 0)
+            throw std::logic_error("robust queue handles hold one reservation at a time");
+        auto pos = data_->enqueue_pos.load(std::memory_order_relaxed);
+        if (!claim_for_write(pos)) {
+            count(&queue_metrics_t::full);
+            return reservation();
+        }
+        count_enqueued(pos, 1);
+        return reservation(this, &seq_at(pos), &data_at(pos), pos, self_);
+    }
+
+    peeked try_peek() {
+        auto pos = data_->dequeue_pos.load(std::memory_order_relaxed);
+        if (!claim_for_read(pos)) {
+            on_empty(pos);
+            count(&queue_metrics_t::empty);
+            return peeked();
+        }
+        count(&queue_metrics_t::dequeued);
+        return peeked(data_, &seq_at(pos), &data_at(pos), pos);
+    }
+
+    // Number of reservations that were dropped without being committed,
+    // including cells recovered from dead producers.
+    std::size_t abandoned_count() const {
+        return data_->abandoned.load(std::memory_order_relaxed);
+    }
+
+    // Number of cells that recover() took back from dead producers.
+    std::size_t recovered_count() const {
+        return data_->recovered.load(std::memory_order_relaxed);
+    }
+
+    // Robust queues only: frees the table entries of producers that have
+    // exited and publishes every cell one of them claimed but never published
+    // as abandoned, so consumers skip it instead of stalling behind it.
+    // Consumers call this on their own once the cell at the head stays
+    // unpublished for `recovery_timeout`; a supervisor may call it at any time.
+    // Returns the number of cells recovered.
+    std::size_t recover() {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < data_->producer_slots; i++) {
+            auto& e   = producers_[i];
+            auto  pid = e.pid.load(std::memory_order_acquire);
+            if (pid < 0) {
+                if (kill(-pid, 0) != 0 && errno == ESRCH)   // died while registering
+                    e.pid.compare_exchange_strong(pid, 0, std::memory_order_release);
+                continue;
+            }
+            if (pid == 0 || process_alive(pid, e.start_time.load(std::memory_order_relaxed)))
+                continue;
+
+            auto count = e.pending_count.load(std::memory_order_acquire);
+            auto first = e.pending_pos.load(std::memory_order_relaxed);
+            for (std::size_t p = first; p < first + count; p++)
+                n += poison(p);
+            e.pending_count.store(0, std::memory_order_relaxed);
+            e.pid.compare_exchange_strong(pid, 0, std::memory_order_release);
+        }
+        if (n) {
+            data_->recovered.fetch_add(n, std::memory_order_relaxed);
+            published(n);
+        }
+        return n;
+    }
+
+    // Claims up to `n` consecutive cells with a single CAS on enqueue_pos and
+    // fills them from `items`. Returns how many messages were enqueued (0 if full).
+    std::size_t enqueue_bulk(const Payload* items, std::size_t n) {
+        auto pos = data_->enqueue_pos.load(std::memory_order_relaxed);
+        auto k   = claim_range_for_write(pos, n);
+
+        for (std::size_t i = 0; i < k; i++) {
+            data_at(pos + i) = items[i];
+            seq_at(pos + i).store(pos + i + 1, std::memory_order_release);
+        }
+        settle();
+        if (k) count_enqueued(pos, k);
+        else   count(&queue_metrics_t::full);
+        if (k) published(k);
+        return k;
+    }
+
+    // Claims up to `n` consecutive ready cells with a single CAS on dequeue_pos
+    // and drains them into `out`. Returns how many messages were dequeued (0 if empty).
+    std::size_t dequeue_bulk(Payload* out, std::size_t n) {
+        auto pos = data_->dequeue_pos.load(std::memory_order_relaxed);
+        auto k   = claim_range_for_read(pos, n);
+        if (k == 0) {
+            on_empty(pos);
+            count(&queue_metrics_t::empty);
+        } else {
+            count(&queue_metrics_t::dequeued, k);
+        }
+
+        for (std::size_t i = 0; i < k; i++) {
+            out[i] = data_at(pos + i);
+            seq_at(pos + i).store(pos + i + capacity_, std::memory_order_release);
+        }
+        if (k) notify_waiters(data_->not_full, data_->producers_waiting, k);
+        return k;
+    }
+
+    // Blocking variants: spin for a while, then sleep on a futex in the segment
+    // until the queue changes state or `timeout` expires. Return false on timeout.
+    bool enqueue_wait(const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        return waiter_.wait_until([&] { return enqueue(v); },
+                          data_->not_full, data_->producers_waiting, timeout);
+    }
+
+    // On a robust queue the sleep is cut into recovery_timeout slices, since a
+    // dead producer never wakes anyone up.
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout) {
+        if (!self_)
+            return waiter_.wait_until([&] { return dequeue(out); },
+                                      data_->not_empty, data_->consumers_waiting, timeout);
 
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (timeout != no_timeout)
+            deadline = std::chrono::steady_clock::now() + timeout;
         for (;;) {
-            c   = &q->buf[pos & q->mask];
-            auto seq = c->seq.load(std::memory_order_acquire);
+            auto slice = recovery_timeout_;
+            if (deadline != std::chrono::steady_clock::time_point::max())
+                slice = std::min<std::chrono::nanoseconds>(slice, deadline - std::chrono::steady_clock::now());
+            if (waiter_.wait_until([&] { return dequeue(out); },
+                                   data_->not_empty, data_->consumers_waiting, std::max(slice, std::chrono::nanoseconds::zero())))
+                return true;
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+        }
+    }
+
+    // Event-loop integration, for segments created with listener_slots.
+    // notify_fd() registers this handle as a listener on first use and
+    // returns a descriptor to poll for readability. Producers only write to
+    // it when they publish into a queue this handle has armed, i.e. found
+    // empty, so an idle queue costs neither side anything:
+    //
+    //     do { while (q.dequeue(m)) handle(m); } while (!q.arm_notify());
+    //
+    // run once at startup and whenever the fd becomes readable. Every armed
+    // listener is signalled, so with several of them some wake up to an
+    // empty queue. On a robust queue, also dequeue every recovery_timeout:
+    // a dead producer never signals.
+    int notify_fd() {
+        if (!listening_) register_listener();
+        return notify_fd_;
+    }
+
+    // Drains the fd and arms it. Returns false if the queue is not empty,
+    // in which case nothing is armed and the caller should dequeue again.
+    bool arm_notify() {
+        char buf[64];
+        int  fd = notify_fd();
+        while (read(fd, buf, sizeof(buf)) > 0) {}
+
+        if (listening_->armed.exchange(1, std::memory_order_relaxed) == 0)
+            data_->listeners_armed.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);   // pairs with the one in published()
+        if (!readable())
+            return true;
+        disarm();
+        return false;
+    }
+
+private:
+    shm_segment     segment_;
+    queue_data_t*   data_;
+    char*           cells_    = nullptr;
+    std::size_t     capacity_ = 0;
+    adaptive_waiter waiter_;
+
+    // Robust mode: the producer table and this handle's entry in it, plus
+    // the consumer-side stall detector that triggers recover().
+    producer_entry_t*                     producers_ = nullptr;
+    producer_entry_t*                     self_      = nullptr;
+    std::chrono::nanoseconds              recovery_timeout_;
+    bool                                  stalled_   = false;
+    std::size_t                           stall_pos_ = 0;
+    std::chrono::steady_clock::time_point stall_since_;
+
+    queue_metrics_t*                      metrics_   = nullptr;    // IPC_MPMC_METRICS only
+
+    // Listener table; the entry and FIFO of this handle if it listens, and
+    // the FIFOs this handle has opened as a producer, with the generation
+    // of the listener they were opened for.
+    std::string                               notify_dir_;
+    listener_entry_t*                         listeners_ = nullptr;
+    listener_entry_t*                         listening_ = nullptr;
+    int                                       notify_fd_ = -1;
+    std::vector<std::pair<int, std::uint32_t>> signal_fds_;
+
+    shm_mpmc_bounded_queue(shm_mpmc_bounded_queue const&) = delete;
+    void operator=(shm_mpmc_bounded_queue const&) = delete;
+
+    seq_t& seq_at(std::size_t pos) {
+        return cells_t::seq(cells_, capacity_, pos & (capacity_ - 1));
+    }
+
+    Payload& data_at(std::size_t pos) {
+        return cells_t::data(cells_, capacity_, pos & (capacity_ - 1));
+    }
+
+    // Vyukov's claim loops. On success `pos` is the claimed position. A
+    // single-sided end owns its index outright, so it only checks the cell and
+    // stores the index instead of looping on a CAS.
+    bool claim_for_write(std::size_t& pos) {
+        auto* q = data_;
+
+        if constexpr (!Concurrency::multi_producer) {
+            if (seq_at(pos).load(std::memory_order_acquire) != pos)
+                return false;                          // full
+            announce(pos, 1);
+            q->enqueue_pos.store(pos + 1, std::memory_order_relaxed);
+            return true;
+        }
+        for (;;) {
+            auto seq = seq_at(pos).load(std::memory_order_acquire);
             auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
 
             if (dif == 0) {
+                announce(pos, 1);
                 if (q->enqueue_pos.compare_exchange_weak(
                         pos, pos + 1, std::memory_order_relaxed))
-                    break;
+                    return true;
+                count(&queue_metrics_t::enqueue_retries);
             } else if (dif < 0) {
+                settle();
                 return false;                          // full
             } else {
+                count(&queue_metrics_t::enqueue_retries);
                 pos = q->enqueue_pos.load(std::memory_order_relaxed);
             }
         }
-        c->data = v;
-        c->seq.store(pos + 1, std::memory_order_release);
-        return true;
     }
 
-    bool dequeue(Payload& out) {
-        auto* q   = data_;
-        auto  pos = q->dequeue_pos.load(std::memory_order_relaxed);
-        cell_t* c;
+    bool claim_for_read(std::size_t& pos) {
+        auto* q = data_;
 
         for (;;) {
-            c   = &q->buf[pos & q->mask];
-            auto seq = c->seq.load(std::memory_order_acquire);
-            auto dif = static_cast<std::intptr_t>(seq) -
+            auto seq = seq_at(pos).load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq & ~seq_abandoned) -
                        static_cast<std::intptr_t>(pos + 1);
 
+            if constexpr (!Concurrency::multi_consumer) {
+                if (dif != 0) return false;            // empty
+                q->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+                if (!(seq & seq_abandoned))
+                    return true;
+                skip_abandoned(pos++);
+                continue;
+            }
             if (dif == 0) {
                 if (q->dequeue_pos.compare_exchange_weak(
-                        pos, pos + 1, std::memory_order_relaxed))
-                    break;
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    if (!(seq & seq_abandoned))
+                        return true;
+                    skip_abandoned(pos);
+                    pos = q->dequeue_pos.load(std::memory_order_relaxed);
+                } else {
+                    count(&queue_metrics_t::dequeue_retries);
+                }
             } else if (dif < 0) {
                 return false;                          // empty
             } else {
+                count(&queue_metrics_t::dequeue_retries);
                 pos = q->dequeue_pos.load(std::memory_order_relaxed);
             }
         }
-        out = c->data;
-        c->seq.store(pos + q->mask + 1, std::memory_order_release);
-        return true;
     }
 
-private:
-    using cell_t = typename queue_data_t<Payload>::cell;
+    // Bulk claims: count the run of consecutive cells in the expected state
+    // starting at `pos` (at most `n`) and take the whole run with one update
+    // of the index. Return the run length, 0 if full/empty.
+    std::size_t claim_range_for_write(std::size_t& pos, std::size_t n) {
+        auto* q = data_;
+        std::size_t k;
+
+        if (n == 0) return 0;
+        for (;;) {
+            auto seq = seq_at(pos).load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+
+            if (dif == 0) {
+                for (k = 1; k < n; k++) {
+                    if (seq_at(pos + k).load(std::memory_order_acquire) != pos + k)
+                        break;
+                }
+                announce(pos, k);
+                if constexpr (!Concurrency::multi_producer) {
+                    q->enqueue_pos.store(pos + k, std::memory_order_relaxed);
+                    return k;
+                }
+                if (q->enqueue_pos.compare_exchange_weak(
+                        pos, pos + k, std::memory_order_relaxed))
+                    return k;
+                count(&queue_metrics_t::enqueue_retries);
+            } else if (dif < 0 || !Concurrency::multi_producer) {
+                settle();
+                return 0;                              // full
+            } else {
+                count(&queue_metrics_t::enqueue_retries);
+                pos = q->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
+    std::size_t claim_range_for_read(std::size_t& pos, std::size_t n) {
+        auto* q = data_;
+        std::size_t k;
 
-    std::string             shm_name_;
-    int                     fd_;
-    queue_data_t<Payload>*  data_;
-    bool                    owner_;
+        if (n == 0) return 0;
+        for (;;) {
+            auto seq = seq_at(pos).load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq & ~seq_abandoned) -
+                       static_cast<std::intptr_t>(pos + 1);
 
-    shm_mpmc_bounded_queue(shm_mpmc_bounded_queue const&) = delete;
-    void operator=(shm_mpmc_bounded_queue const&) = delete;
+            if (dif == 0) {
+                // an abandoned cell is claimed alone and skipped
+                for (k = 1; k < n && !(seq & seq_abandoned); k++) {
+                    if (seq_at(pos + k).load(std::memory_order_acquire) != pos + k + 1)
+                        break;
+                }
+                bool claimed;
+                if constexpr (!Concurrency::multi_consumer) {
+                    q->dequeue_pos.store(pos + k, std::memory_order_relaxed);
+                    claimed = true;
+                } else {
+                    claimed = q->dequeue_pos.compare_exchange_weak(
+                        pos, pos + k, std::memory_order_relaxed);
+                }
+                if (claimed) {
+                    if (!(seq & seq_abandoned))
+                        return k;
+                    skip_abandoned(pos);
+                    pos = q->dequeue_pos.load(std::memory_order_relaxed);
+                } else {
+                    count(&queue_metrics_t::dequeue_retries);
+                }
+            } else if (dif < 0 || !Concurrency::multi_consumer) {
+                return 0;                              // empty
+            } else {
+                count(&queue_metrics_t::dequeue_retries);
+                pos = q->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Wakes consumers after `n` cells were published. The fence in
+    // notify_waiters() orders the publication before the listeners_armed
+    // load, against the fence in arm_notify().
+    void published(std::size_t n) {
+        notify_waiters(data_->not_empty, data_->consumers_waiting, n);
+        if (listeners_ && data_->listeners_armed.load(std::memory_order_relaxed) != 0)
+            signal_listeners();
+    }
+
+    // Disarms every armed listener and writes a byte to its FIFO. The
+    // exchange makes sure only one producer signals each transition.
+    void signal_listeners() {
+        for (std::size_t i = 0; i < data_->listener_slots; i++) {
+            auto& e = listeners_[i];
+            if (e.armed.load(std::memory_order_relaxed) == 0 ||
+                e.armed.exchange(0, std::memory_order_relaxed) == 0)
+                continue;
+            data_->listeners_armed.fetch_sub(1, std::memory_order_relaxed);
 
-    void open_segment(bool create_or_attach) {
-        int flags = O_RDWR | (create_or_attach ? O_CREAT : 0);
-        fd_       = shm_open(shm_name_.c_str(), flags, 0666);
+            auto  gen = e.generation.load(std::memory_order_acquire);
+            auto& fd  = signal_fds_[i];
+            if (fd.first < 0 || fd.second != gen) {
+                if (fd.first >= 0) close(fd.first);
+                // fails with ENXIO if the listener is gone; it is retried on the next signal
+                fd = { open(listener_path(i).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC), gen };
+            }
+            char b = 1;
+            if (fd.first >= 0 && write(fd.first, &b, 1) < 0 && errno != EAGAIN) {
+                close(fd.first);
+                fd.first = -1;
+            }
+        }
+    }
+
+    // Whether the cell at the head is published (or abandoned), i.e. a
+    // dequeue() would not find the queue empty.
+    bool readable() {
+        auto pos = data_->dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            auto seq = seq_at(pos).load(std::memory_order_acquire);
+            auto dif = static_cast<std::intptr_t>(seq & ~seq_abandoned) -
+                       static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0) return true;
+            if (dif < 0)  return false;
+            pos = data_->dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
 
-        if (fd_ < 0) throw std::runtime_error("shm_open failed");
+    void disarm() {
+        if (listening_->armed.exchange(0, std::memory_order_relaxed) != 0)
+            data_->listeners_armed.fetch_sub(1, std::memory_order_relaxed);
+    }
 
-        struct stat st {};
-        fstat(fd_, &st);
-        bool need_init = (st.st_size == 0);
-        if (need_init) {
-            if (ftruncate(fd_, sizeof(queue_data_t<Payload>)) != 0) throw std::runtime_error("ftruncate failed");
+    std::string listener_path(std::size_t slot) const {
+        const auto& name = segment_.name();
+        return notify_dir_ + "/" + name.substr(name[0] == '/' ? 1 : 0) + ".notify." + std::to_string(slot);
+    }
+
+    // Takes a free entry of the listener table (or one whose owner has
+    // exited) and creates its FIFO. The FIFO is opened read-write so that
+    // it never reports EOF while no producer has it open.
+    void register_listener() {
+        if (!listeners_)
+            throw std::logic_error("queue was created without listener slots");
+        auto pid   = static_cast<std::int32_t>(getpid());
+        auto start = process_start_time(pid);
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (std::size_t i = 0; i < data_->listener_slots; i++) {
+                std::int32_t expected = 0;
+                auto& e = listeners_[i];
+                if (!e.pid.compare_exchange_strong(expected, -pid, std::memory_order_acquire))
+                    continue;
+
+                auto path = listener_path(i);
+                unlink(path.c_str());
+                if (mkfifo(path.c_str(), 0666) != 0 ||
+                    (notify_fd_ = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+                    unlink(path.c_str());
+                    e.pid.store(0, std::memory_order_release);
+                    throw std::runtime_error(path + ": cannot create notification FIFO");
+                }
+                e.start_time.store(start, std::memory_order_relaxed);
+                e.generation.fetch_add(1, std::memory_order_release);
+                e.pid.store(pid, std::memory_order_release);
+                listening_ = &e;
+                return;
+            }
+            reap_listeners();
         }
-        void* p = mmap(nullptr, sizeof(queue_data_t<Payload>), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
-        if (p == MAP_FAILED) throw std::runtime_error("mmap failed");
-        data_ = static_cast<queue_data_t<Payload>*>(p);
-        if (need_init) {
-            owner_ = true;
-            init_queue<Payload>(data_);
+        throw std::runtime_error("listener table is full");
+    }
+
+    // Frees the entries of listeners that exited without closing their
+    // handle. The entry is held as registering while it is disarmed, so a
+    // new owner never sees it half reset. Their FIFOs are left behind until
+    // the slot is reused.
+    void reap_listeners() {
+        auto self = static_cast<std::int32_t>(getpid());
+        for (std::size_t i = 0; i < data_->listener_slots; i++) {
+            auto& e   = listeners_[i];
+            auto  pid = e.pid.load(std::memory_order_acquire);
+            bool  dead = pid < 0 ? kill(-pid, 0) != 0 && errno == ESRCH
+                                 : pid > 0 && !process_alive(pid, e.start_time.load(std::memory_order_relaxed));
+            if (!dead || !e.pid.compare_exchange_strong(pid, -self, std::memory_order_acquire))
+                continue;
+            if (e.armed.exchange(0, std::memory_order_relaxed) != 0)
+                data_->listeners_armed.fetch_sub(1, std::memory_order_relaxed);
+            e.pid.store(0, std::memory_order_release);
         }
     }
-};
 
+    void unregister_listener() {
+        disarm();
+        close(notify_fd_);
+        unlink(listener_path(listening_ - listeners_).c_str());
+        listening_->pid.store(0, std::memory_order_release);
+    }
+
+    // Hands a claimed, abandoned cell straight back to the producers.
+    void skip_abandoned(std::size_t pos) {
+        data_->abandoned.fetch_add(1, std::memory_order_relaxed);
+        seq_at(pos).store(pos + capacity_, std::memory_order_release);
+        notify_waiters(data_->not_full, data_->producers_waiting, 1);
+    }
+
+    // Robust mode: publish the positions this handle is about to claim
+    // before the claim itself becomes visible, and withdraw them once the
+    // cells are published (or the claim failed).
+    void announce(std::size_t pos, std::size_t n) {
+        if (!self_) return;
+        self_->pending_pos.store(pos, std::memory_order_relaxed);
+        self_->pending_count.store(n, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void settle() {
+        if (self_) self_->pending_count.store(0, std::memory_order_release);
+    }
+
+    // Publishes cell `p` as abandoned if it was claimed, is still unpublished
+    // and no live producer has announced it. The CAS loses against a
+    // producer that publishes concurrently.
+    bool poison(std::size_t p) {
+        if (data_->enqueue_pos.load(std::memory_order_acquire) <= p)
+            return false;                              // never claimed
+        for (std::size_t i = 0; i < data_->producer_slots; i++) {
+            auto& e     = producers_[i];
+            auto  pid   = e.pid.load(std::memory_order_acquire);
+            auto  count = e.pending_count.load(std::memory_order_acquire);
+            auto  first = e.pending_pos.load(std::memory_order_relaxed);
+            if (pid > 0 && count && p - first < count &&
+                process_alive(pid, e.start_time.load(std::memory_order_relaxed)))
+                return false;
+        }
+        auto expected = p;
+        return seq_at(p).compare_exchange_strong(expected, (p + 1) | seq_abandoned,
+                                                 std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    // Called by consumers that found the head cell unpublished. If it stays
+    // that way for recovery_timeout while producers have moved past it, the
+    // producer that claimed it is probably gone.
+    void on_empty(std::size_t pos) {
+        if (!self_) return;
+        if (data_->enqueue_pos.load(std::memory_order_relaxed) <= pos) {
+            stalled_ = false;                          // really empty
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (!stalled_ || stall_pos_ != pos) {
+            stalled_     = true;
+            stall_pos_   = pos;
+            stall_since_ = now;
+        } else if (now - stall_since_ >= recovery_timeout_) {
+            recover();
+            stall_since_ = now;
+        }
+    }
+
+    // Metrics. Without IPC_MPMC_METRICS these are empty and compile away.
+    // The owner is the only writer of its line, so no RMW is needed.
+    void count([[maybe_unused]] std::atomic<std::uint64_t> queue_metrics_t::* field,
+               [[maybe_unused]] std::uint64_t n = 1) {
+#ifdef IPC_MPMC_METRICS
+        if (!metrics_) return;
+        auto& c = metrics_->*field;
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#endif
+    }
+
+    void count_enqueued([[maybe_unused]] std::size_t pos, [[maybe_unused]] std::size_t n) {
+#ifdef IPC_MPMC_METRICS
+        if (!metrics_) return;
+        count(&queue_metrics_t::enqueued, n);
+        auto head = data_->dequeue_pos.load(std::memory_order_relaxed);
+        if (head < pos + n && pos + n - head > metrics_->max_depth.load(std::memory_order_relaxed))
+            metrics_->max_depth.store(pos + n - head, std::memory_order_relaxed);
+#endif
+    }
+
+#ifdef IPC_MPMC_METRICS
+    void register_metrics() {
+        auto* table = metrics_table(data_);
+        auto  pid   = static_cast<std::int32_t>(getpid());
+        auto  start = static_cast<std::uint32_t>(process_start_time(pid));
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (std::size_t i = 1; i < data_->metrics_slots; i++) {
+                std::int32_t expected = 0;
+                auto& m = table[i];
+                if (!m.pid.compare_exchange_strong(expected, -pid, std::memory_order_acquire))
+                    continue;
+                m.start_time.store(start, std::memory_order_relaxed);
+                m.pid.store(pid, std::memory_order_release);
+                metrics_ = &m;
+                return;
+            }
+            reap_metrics();
+        }
+        // every slot belongs to a live handle: this one goes uncounted
+    }
+
+    // Frees the slots of processes that exited without closing their
+    // handles, after folding their counters into slot 0. The slot is held as
+    // registering meanwhile, so only one reaper folds it.
+    void reap_metrics() {
+        auto* table = metrics_table(data_);
+        auto  self  = static_cast<std::int32_t>(getpid());
+        for (std::size_t i = 1; i < data_->metrics_slots; i++) {
+            auto& m   = table[i];
+            auto  pid = m.pid.load(std::memory_order_acquire);
+            bool  dead = pid < 0 ? kill(-pid, 0) != 0 && errno == ESRCH
+                                 : pid > 0 && ((kill(pid, 0) != 0 && errno == ESRCH) ||
+                                               static_cast<std::uint32_t>(process_start_time(pid)) !=
+                                                   m.start_time.load(std::memory_order_relaxed));
+            if (dead && m.pid.compare_exchange_strong(pid, -self, std::memory_order_acquire))
+                fold_metrics(m);
+        }
+    }
+
+    void retire_metrics() { fold_metrics(*metrics_); }
+
+    // Adds the counters of `m` to slot 0 and frees its line.
+    void fold_metrics(queue_metrics_t& m) {
+        auto& total = metrics_table(data_)[0];
+        for (auto field : { &queue_metrics_t::enqueued, &queue_metrics_t::dequeued, &queue_metrics_t::full,
+                            &queue_metrics_t::empty, &queue_metrics_t::enqueue_retries,
+                            &queue_metrics_t::dequeue_retries }) {
+            (total.*field).fetch_add((m.*field).load(std::memory_order_relaxed), std::memory_order_relaxed);
+            (m.*field).store(0, std::memory_order_relaxed);
+        }
+        auto depth = m.max_depth.exchange(0, std::memory_order_relaxed);
+        auto seen  = total.max_depth.load(std::memory_order_relaxed);
+        while (depth > seen && !total.max_depth.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {}
+        m.pid.store(0, std::memory_order_release);
+    }
+#endif
+
+    void register_producer() {
+        producers_ = reinterpret_cast<producer_entry_t*>(cells_ + producer_table_offset(cells_t::bytes(capacity_)));
+        auto pid   = static_cast<std::int32_t>(getpid());
+        auto start = process_start_time(pid);
+
+        for (int attempt = 0; attempt < 2; attempt++) {
+            for (std::size_t i = 0; i < data_->producer_slots; i++) {
+                std::int32_t expected = 0;
+                auto& e = producers_[i];
+                if (!e.pid.compare_exchange_strong(expected, -pid, std::memory_order_acquire))
+                    continue;
+                e.start_time.store(start, std::memory_order_relaxed);
+                e.pending_count.store(0, std::memory_order_relaxed);
+                e.pid.store(pid, std::memory_order_release);
+                self_ = &e;
+                return;
+            }
+            recover();                                 // frees entries of dead processes
+        }
+        throw std::runtime_error("producer table is full");
+    }
+
+    static std::size_t checked_segment_size(std::size_t capacity, std::size_t producer_slots,
+                                            std::size_t metrics_slots, std::size_t listener_slots) {
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("capacity must be a power of 2");
+        return segment_size(capacity, producer_slots, metrics_slots, listener_slots);
+    }
+};
@@ -0,0 +1,171 @@
+// Multi-band priority queue: one Vyukov ring per priority band in a single
+// segment. Band 0 is the most urgent. Consumers always drain higher bands
+// first, so a control message never waits behind a backlog of bulk data in a
+// lower band. Messages are FIFO within a band, not across bands.
+//
+// Strict priority can starve the lower bands under sustained load. A handle
+// with a starvation quota Q starts every (Q+1)-th dequeue at the next lower
+// band in turn instead of at band 0, which guarantees each band a share of
+// that consumer's dequeues.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t default_band_count   = 4;
+constexpr std::size_t priority_layout_flag = 0x800;   // or-ed into header.layout
+
+}
+
+// Control block at the start of a priority segment; one ring per band
+// follows it, each a queue_data_t with its cells, starting on a cache line.
+struct priority_data_t {
+    segment_header_t header;        // describes a single band
+    std::size_t bands;
+    std::size_t band_bytes;         // stride between bands
+
+    // Futex words shared by all bands, see queue_data_t. Producers wait for
+    // room in one band, so they sleep on that band's own not_full word.
+    alignas(cache_line)
+    std::atomic<std::uint32_t> not_empty;
+    std::atomic<std::uint32_t> consumers_waiting;
+
+    queue_data_t* band(std::size_t i) {
+        return reinterpret_cast<queue_data_t*>(reinterpret_cast<char*>(this) + sizeof(priority_data_t) + i * band_bytes);
+    }
+};
+
+template <typename Payload, typename Layout = padded_cells>
+class shm_priority_queue {
+    using cells_t = typename Layout::template cells<Payload>;
+    using ring_t  = ring_ops<Payload, Layout>;
+
+public:
+    // `bands` and `band_capacity` are only used by the creator; attachers take
+    // them from the segment header. Every band gets the same capacity: the
+    // bands sit at a fixed stride, so band(i) is one multiply and the header
+    // describes all of them. Size it for the busiest band; a small control
+    // band then costs as much memory as a bulk band.
+    explicit shm_priority_queue(const std::string& shm_name,
+                                std::size_t bands = default_band_count,
+                                std::size_t band_capacity = default_queue_size / default_band_count,
+                                bool create_segment = true,
+                                const segment_options_t& options = {})
+        : segment_(shm_name, create_segment, checked_segment_size(bands, band_capacity), options),
+          data_(static_cast<priority_data_t*>(segment_.data()))
+    {
+        if (segment_.created()) {
+            init(bands, band_capacity);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, Layout::id | priority_layout_flag, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, cells_t::stride, "cell size");
+            segment_.check_field(data_->band_bytes, ring_t::block_bytes(h.capacity), "band size");
+            if (data_->bands == 0 || segment_size(data_->bands, h.capacity) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        bands_ = data_->bands;
+    }
+
+    std::size_t bands()         const { return bands_; }
+    std::size_t band_capacity() const { return data_->header.capacity; }
+
+    static std::size_t segment_size(std::size_t bands, std::size_t band_capacity) {
+        return sizeof(priority_data_t) + bands * ring_t::block_bytes(band_capacity);
+    }
+
+    // Every (quota+1)-th dequeue of this handle starts at a lower band.
+    // 0 (the default) means strict priority.
+    void set_starvation_quota(std::size_t quota) { quota_ = quota; }
+
+    // Enqueues into `band` (0 = highest priority). Returns false if that band is full.
+    bool enqueue(const Payload& v, std::size_t band) {
+        if (band >= bands_)
+            throw std::out_of_range("priority band out of range");
+        if (!ring_t::push(data_->band(band), v)) return false;
+        notify_waiters(data_->not_empty, data_->consumers_waiting, 1);
+        return true;
+    }
+
+    // Dequeues from the highest non-empty band. If `band` is given, it
+    // receives the band the message came from.
+    bool dequeue(Payload& out, std::size_t* band = nullptr) {
+        std::size_t start = 0;
+        if (quota_ && bands_ > 1 && ++since_turn_ > quota_) {
+            since_turn_ = 0;
+            turn_       = turn_ % (bands_ - 1) + 1;
+            start       = turn_;
+        }
+        for (std::size_t i = 0; i < bands_; i++) {
+            auto b = (start + i) % bands_;
+            auto* q = data_->band(b);
+            if (ring_t::pop(q, out)) {
+                if (band) *band = b;
+                notify_waiters(q->not_full, q->producers_waiting, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool enqueue_wait(const Payload& v, std::size_t band, std::chrono::nanoseconds timeout = no_timeout) {
+        if (band >= bands_)
+            throw std::out_of_range("priority band out of range");
+        auto* q = data_->band(band);
+        return waiter_.wait_until([&] { return enqueue(v, band); },
+                                  q->not_full, q->producers_waiting, timeout);
+    }
+
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout, std::size_t* band = nullptr) {
+        return waiter_.wait_until([&] { return dequeue(out, band); },
+                                  data_->not_empty, data_->consumers_waiting, timeout);
+    }
+
+private:
+    shm_segment      segment_;
+    priority_data_t* data_;
+    std::size_t      bands_      = 0;
+    std::size_t      quota_      = 0;
+    std::size_t      since_turn_ = 0;   // dequeues since a lower band last went first
+    std::size_t      turn_       = 0;   // lower band that went first last time
+    adaptive_waiter  waiter_;
+
+    shm_priority_queue(shm_priority_queue const&) = delete;
+    void operator=(shm_priority_queue const&) = delete;
+
+    void init(std::size_t bands, std::size_t band_capacity) {
+        auto* d = data_;
+        d->header.capacity      = band_capacity;
+        d->header.cell_size     = cells_t::stride;
+        d->header.payload_size  = sizeof(Payload);
+        d->header.payload_align = alignof(Payload);
+        d->header.layout        = Layout::id | priority_layout_flag;
+        d->bands      = bands;
+        d->band_bytes = ring_t::block_bytes(band_capacity);
+        d->not_empty.store(0, std::memory_order_relaxed);
+        d->consumers_waiting.store(0, std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < bands; i++)
+            init_queue<Payload, Layout>(d->band(i), band_capacity);
+    }
+
+    static std::size_t checked_segment_size(std::size_t bands, std::size_t band_capacity) {
+        if (bands == 0)
+            throw std::invalid_argument("a priority queue needs at least one band");
+        if (band_capacity < 2 || (band_capacity & (band_capacity - 1)) != 0)
+            throw std::invalid_argument("band capacity must be a power of 2");
+        return segment_size(bands, band_capacity);
+    }
+};
@@ -0,0 +1,136 @@
+// Typed message schemas: several message types over one queue, written in
+// place into the queue cell and dispatched on the consumer side without an
+// intermediate copy.
+//
+// A message type is a trivially copyable, standard-layout struct with a
+// unique `static constexpr std::uint16_t tag`. A schema lists them and
+// defines the queue payload, an envelope with the tag at offset 0 and the
+// body at a fixed offset, sized for the largest message:
+//
+//     struct order_t  { static constexpr std::uint16_t tag = 1; std::uint64_t id; double price; };
+//     struct cancel_t { static constexpr std::uint16_t tag = 2; std::uint64_t id; };
+//     using schema_t = message_schema<order_t, cancel_t>;
+//
+//     shm_mpmc_bounded_queue<schema_t::envelope_t> q("/orders", 4096);
+//     schema_t::try_write<order_t>(q, [&](order_t& o) { o.id = 7; o.price = 1.5; });
+//     schema_t::try_read(q, overloaded {
+//         [](const order_t& o)  { ... },
+//         [](const cancel_t& c) { ... },
+//     });
+//
+// Tags, not list positions, identify the types on the wire, so types can be
+// added to the end of a schema without renumbering the others.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// Builds a visitor out of lambdas, one per message type.
+template <typename... Fs>
+struct overloaded : Fs... {
+    using Fs::operator()...;
+};
+template <typename... Fs>
+overloaded(Fs...) -> overloaded<Fs...>;
+
+template <typename... Messages>
+class message_schema {
+    static_assert(sizeof...(Messages) > 0, "a schema needs at least one message type");
+    static_assert((std::is_trivially_copyable_v<Messages> && ...),
+                  "message types are copied between processes byte by byte and must be trivially copyable");
+    static_assert((std::is_standard_layout_v<Messages> && ...),
+                  "message types must be standard-layout so their field offsets are fixed");
+    static_assert((std::is_same_v<std::remove_cv_t<decltype(Messages::tag)>, std::uint16_t> && ...),
+                  "every message type needs a static constexpr std::uint16_t tag");
+
+    static constexpr std::array<std::uint16_t, sizeof...(Messages)> tags { Messages::tag... };
+
+    static constexpr bool unique_tags() {
+        for (std::size_t i = 0; i < tags.size(); i++)
+            for (std::size_t j = i + 1; j < tags.size(); j++)
+                if (tags[i] == tags[j]) return false;
+        return true;
+    }
+    static_assert(unique_tags(), "message tags must be unique within a schema");
+
+public:
+    static constexpr std::size_t   body_size  = std::max({ sizeof(Messages)... });
+    static constexpr std::size_t   body_align = std::max({ alignof(Messages)... });
+    static constexpr std::uint16_t max_tag    = std::max({ Messages::tag... });
+    static_assert(max_tag < 4096, "tags index a dispatch table, keep them small");
+
+    // The queue payload. Only the first sizeof(M) bytes of `body` are written
+    // for a message of type M.
+    struct envelope_t {
+        std::uint16_t tag;
+        alignas(body_align) unsigned char body[body_size];
+    };
+
+    template <typename M>
+    static constexpr bool contains = (std::is_same_v<M, Messages> || ...);
+
+    // Starts a message of type M in `e` and returns it for the caller to fill
+    // in. Fields are not initialized.
+    template <typename M>
+    static M& emplace(envelope_t& e) {
+        static_assert(contains<M>, "message type is not part of this schema");
+        e.tag = M::tag;
+        return *::new (static_cast<void*>(e.body)) M;
+    }
+
+    // The message in `e` if it is an M, nullptr otherwise.
+    template <typename M>
+    static const M* get(const envelope_t& e) {
+        static_assert(contains<M>, "message type is not part of this schema");
+        return e.tag == M::tag ? std::launder(reinterpret_cast<const M*>(e.body)) : nullptr;
+    }
+
+    // Calls `v` with the message in `e`, as its own type. Returns false if
+    // the tag is not part of this schema.
+    template <typename Visitor>
+    static bool visit(const envelope_t& e, Visitor&& v) {
+        using handler_t = void (*)(const unsigned char*, Visitor&);
+        static constexpr auto table = [] {
+            std::array<handler_t, max_tag + 1> t {};
+            ((t[Messages::tag] = [](const unsigned char* body, Visitor& v) {
+                  v(*std::launder(reinterpret_cast<const Messages*>(body)));
+              }), ...);
+            return t;
+        }();
+        if (e.tag > max_tag || !table[e.tag]) return false;
+        table[e.tag](e.body, v);
+        return true;
+    }
+
+    // Reserves a cell of `q`, lets `fill` write an M straight into it and
+    // publishes it. Returns false if the queue is full. If `fill` throws,
+    // the cell is published as abandoned.
+    template <typename M, typename Queue, typename Fill>
+    static bool try_write(Queue& q, Fill&& fill) {
+        auto r = q.try_reserve();
+        if (!r) return false;
+        fill(emplace<M>(*r));
+        r.commit();
+        return true;
+    }
+
+    // Dispatches the next message of `q` to `v` where it lies in the cell.
+    // Returns false if the queue is empty. A tag outside the schema means the
+    // producer was built with a different schema and throws.
+    template <typename Queue, typename Visitor>
+    static bool try_read(Queue& q, Visitor&& v) {
+        auto m = q.try_peek();
+        if (!m) return false;
+        if (!visit(*m, v))
+            throw std::runtime_error("message tag " + std::to_string(m->tag) + " is not part of this schema");
+        return true;
+    }
+};
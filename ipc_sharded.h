@@ -0,0 +1,201 @@
+// Sharded MPMC queue: several independent Vyukov rings ("lanes") in one
+// segment, so producers and consumers spread over separate enqueue_pos /
+// dequeue_pos pairs instead of all contending on one.
+//
+// Every handle has a home lane, handed out round-robin when it attaches.
+// Producers enqueue into their home lane (or into the lane a key hashes to),
+// so messages from one producer stay in order. Consumers drain their home
+// lane first and steal from the other lanes when it is empty. There is no
+// ordering between lanes.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include "ipc_mpmc.h"
+
+namespace {
+
+constexpr std::size_t default_lane_count = 8;
+constexpr std::size_t sharded_layout_flag = 0x400;    // or-ed into header.layout
+
+}
+
+// Control block at the start of a sharded segment; the lanes follow it, each
+// one a queue_data_t with its cells, starting on a cache line.
+struct sharded_data_t {
+    segment_header_t header;        // describes a single lane
+    std::size_t lanes;
+    std::size_t lane_bytes;         // stride between lanes
+
+    alignas(cache_line)
+    std::atomic<std::size_t> next_home;
+
+    // Futex words shared by all lanes, see queue_data_t: a consumer takes
+    // from any lane. A producer only ever waits for room in one lane, so it
+    // sleeps on that lane's own not_full word instead.
+    alignas(cache_line)
+    std::atomic<std::uint32_t> not_empty;
+    std::atomic<std::uint32_t> consumers_waiting;
+
+    queue_data_t* lane(std::size_t i) {
+        return reinterpret_cast<queue_data_t*>(reinterpret_cast<char*>(this) + sizeof(sharded_data_t) + i * lane_bytes);
+    }
+};
+
+template <typename Payload, typename Layout = padded_cells>
+class shm_sharded_queue {
+    using cells_t = typename Layout::template cells<Payload>;
+    using ring_t  = ring_ops<Payload, Layout>;
+
+public:
+    static constexpr bool sharded = true;
+
+    // `lanes` and `lane_capacity` are only used by the creator; attachers take
+    // them from the segment header.
+    explicit shm_sharded_queue(const std::string& shm_name,
+                               std::size_t lanes = default_lane_count,
+                               std::size_t lane_capacity = default_queue_size / default_lane_count,
+                               bool create_segment = true,
+                               const segment_options_t& options = {})
+        : segment_(shm_name, create_segment, checked_segment_size(lanes, lane_capacity), options),
+          data_(static_cast<sharded_data_t*>(segment_.data()))
+    {
+        if (segment_.created()) {
+            init(lanes, lane_capacity);
+            segment_.publish_header(data_->header);
+        } else {
+            const auto& h = data_->header;
+            segment_.await_header(h);
+            segment_.check_field(h.layout, Layout::id | sharded_layout_flag, "cell layout");
+            segment_.check_field(h.payload_size, sizeof(Payload), "payload size");
+            segment_.check_field(h.payload_align, alignof(Payload), "payload alignment");
+            segment_.check_field(h.cell_size, cells_t::stride, "cell size");
+            segment_.check_field(data_->lane_bytes, lane_bytes(h.capacity), "lane size");
+            if (data_->lanes == 0 || segment_size(data_->lanes, h.capacity) > segment_.size())
+                throw std::runtime_error(shm_name + ": segment is smaller than its header says");
+        }
+        lanes_    = data_->lanes;
+        capacity_ = data_->header.capacity;
+        home_     = data_->next_home.fetch_add(1, std::memory_order_relaxed) % lanes_;
+    }
+
+    std::size_t lanes()         const { return lanes_; }
+    std::size_t lane_capacity() const { return capacity_; }
+    std::size_t home_lane()     const { return home_; }
+
+    // Pins this handle to `lane`, e.g. to keep a consumer next to the
+    // producers that feed that lane.
+    void set_home_lane(std::size_t lane) { home_ = lane % lanes_; }
+
+    static std::size_t segment_size(std::size_t lanes, std::size_t lane_capacity) {
+        return sizeof(sharded_data_t) + lanes * lane_bytes(lane_capacity);
+    }
+
+    // Enqueues into the home lane. Returns false if that lane is full; other
+    // lanes are not tried, so one producer's messages stay in order.
+    bool enqueue(const Payload& v) {
+        return enqueue_to(home_, v);
+    }
+
+    // Enqueues into the lane `key` hashes to, so that all messages with the
+    // same key are delivered in order.
+    template <typename Key>
+    bool enqueue_by_key(const Key& key, const Payload& v) {
+        return enqueue_to(std::hash<Key>{}(key) % lanes_, v);
+    }
+
+    // Dequeues from the home lane, or steals from the next non-empty lane.
+    bool dequeue(Payload& out) {
+        for (std::size_t i = 0; i < lanes_; i++) {
+            auto* lane = data_->lane((home_ + i) % lanes_);
+            if (ring_t::pop(lane, out)) {
+                notify_waiters(lane->not_full, lane->producers_waiting, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Claims up to `n` cells of the home lane with one CAS.
+    std::size_t enqueue_bulk(const Payload* items, std::size_t n) {
+        auto k = ring_t::push_bulk(data_->lane(home_), items, n);
+        if (k) notify_waiters(data_->not_empty, data_->consumers_waiting, k);
+        return k;
+    }
+
+    // Takes a run of up to `n` messages from the home lane with one CAS,
+    // and tops it up from the other lanes with one CAS each.
+    std::size_t dequeue_bulk(Payload* out, std::size_t n) {
+        std::size_t k = 0;
+        for (std::size_t i = 0; i < lanes_ && k < n; i++) {
+            auto* lane = data_->lane((home_ + i) % lanes_);
+            auto  got  = ring_t::pop_bulk(lane, out + k, n - k);
+            if (got) notify_waiters(lane->not_full, lane->producers_waiting, got);
+            k += got;
+        }
+        return k;
+    }
+
+    bool enqueue_wait(const Payload& v, std::chrono::nanoseconds timeout = no_timeout) {
+        auto* lane = data_->lane(home_);
+        return waiter_.wait_until([&] { return enqueue(v); },
+                                  lane->not_full, lane->producers_waiting, timeout);
+    }
+
+    bool dequeue_wait(Payload& out, std::chrono::nanoseconds timeout = no_timeout) {
+        return waiter_.wait_until([&] { return dequeue(out); },
+                                  data_->not_empty, data_->consumers_waiting, timeout);
+    }
+
+private:
+    shm_segment     segment_;
+    sharded_data_t* data_;
+    std::size_t     lanes_    = 0;
+    std::size_t     capacity_ = 0;
+    std::size_t     home_     = 0;
+    adaptive_waiter waiter_;
+
+    shm_sharded_queue(shm_sharded_queue const&) = delete;
+    void operator=(shm_sharded_queue const&) = delete;
+
+    bool enqueue_to(std::size_t lane, const Payload& v) {
+        if (!ring_t::push(data_->lane(lane), v)) return false;
+        notify_waiters(data_->not_empty, data_->consumers_waiting, 1);
+        return true;
+    }
+
+    void init(std::size_t lanes, std::size_t lane_capacity) {
+        auto* d = data_;
+        d->header.capacity      = lane_capacity;
+        d->header.cell_size     = cells_t::stride;
+        d->header.payload_size  = sizeof(Payload);
+        d->header.payload_align = alignof(Payload);
+        d->header.layout        = Layout::id | sharded_layout_flag;
+        d->lanes      = lanes;
+        d->lane_bytes = lane_bytes(lane_capacity);
+        d->next_home.store(0, std::memory_order_relaxed);
+        d->not_empty.store(0, std::memory_order_relaxed);
+        d->consumers_waiting.store(0, std::memory_order_relaxed);
+
+        for (std::size_t i = 0; i < lanes; i++)
+            init_queue<Payload, Layout>(d->lane(i), lane_capacity);
+    }
+
+    static std::size_t lane_bytes(std::size_t lane_capacity) {
+        return ring_t::block_bytes(lane_capacity);
+    }
+
+    static std::size_t checked_segment_size(std::size_t lanes, std::size_t lane_capacity) {
+        if (lanes == 0)
+            throw std::invalid_argument("a sharded queue needs at least one lane");
+        if (lane_capacity < 2 || (lane_capacity & (lane_capacity - 1)) != 0)
+            throw std::invalid_argument("lane capacity must be a power of 2");
+        return segment_size(lanes, lane_capacity);
+    }
+};
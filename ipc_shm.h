@@ -0,0 +1,361 @@
+// Shared-memory plumbing used by the queues: named segments, futex helpers
+// and the spin-then-sleep wait policy.
+
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Describes the ring stored in a segment, so that attachers take the geometry
+// from the creator instead of from their own compile-time constants, and can
+// tell whether the creator's build is compatible with theirs.
+//
+// A fresh segment is all zeroes. The creator fills in the header and the rest
+// of the segment, then publishes it by storing segment_ready into `state`;
+// attachers wait for that before they look at anything else.
+struct segment_header_t {
+    std::uint64_t              magic;           // segment_magic
+    std::uint32_t              version;         // segment_version of the creator
+    std::atomic<std::uint32_t> state;           // 0 until the creator is done, then segment_ready
+    std::size_t capacity;       // number of cells (bytes for the byte queue)
+    std::size_t cell_size;      // stride between cells, in bytes
+    std::size_t payload_size;   // sizeof(Payload) of the creator, 0 if variable
+    std::size_t payload_align;  // alignof(Payload) of the creator, 0 if variable
+    std::size_t layout;         // cell layout id, 0 for the byte queue
+    std::size_t cache_line;     // std::hardware_destructive_interference_size of the creator
+};
+
+constexpr std::uint64_t segment_magic   = 0x3143504d43504953;   // "SIPCMPC1"
+constexpr std::uint32_t segment_version = 2;                    // bump on any layout change
+constexpr std::uint32_t segment_ready   = 1;
+
+namespace {
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// The segment is MAP_SHARED between processes, so the non-private futex ops are used.
+inline void futex_wait(std::atomic<std::uint32_t>* word, std::uint32_t expected, const timespec* timeout) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<std::uint32_t>* word, int n) {
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE, n, nullptr, nullptr, 0);
+}
+
+// Wakes up to `n` threads parked on `word`, but only if someone announced
+// itself in `waiters`. Pairs with the fence in adaptive_waiter::wait_until()
+// so that either the waiter sees the new state or we see the waiter.
+inline void notify_waiters(std::atomic<std::uint32_t>& word, std::atomic<std::uint32_t>& waiters, std::size_t n) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) != 0) {
+        word.fetch_add(1, std::memory_order_relaxed);
+        futex_wake(&word, static_cast<int>(std::min<std::size_t>(n, INT_MAX)));
+    }
+}
+
+// Start time of a process in clock ticks since boot (field 22 of
+// /proc/<pid>/stat), 0 if it does not exist. Together with the pid it names
+// a process unambiguously, even after the pid has been reused.
+inline std::uint64_t process_start_time(pid_t pid) {
+    char path[32], buf[512];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+    FILE* f = std::fopen(path, "r");
+    if (!f) return 0;
+    std::size_t n = std::fread(buf, 1, sizeof(buf) - 1, f);
+    std::fclose(f);
+    buf[n] = '\0';
+
+    // the command name in field 2 may contain spaces, so count from its ')'
+    const char* p = std::strrchr(buf, ')');
+    if (!p) return 0;
+    for (int field = 2; field < 22 && p; field++)
+        p = std::strchr(p + 1, ' ');
+    return p ? std::strtoull(p + 1, nullptr, 10) : 0;
+}
+
+inline bool process_alive(pid_t pid, std::uint64_t start_time) {
+    if (kill(pid, 0) != 0 && errno == ESRCH) return false;
+    return process_start_time(pid) == start_time;
+}
+
+}
+
+constexpr std::chrono::nanoseconds no_timeout = std::chrono::nanoseconds::max();
+
+#ifdef IPC_MPMC_METRICS
+constexpr std::size_t default_metrics_slots = 64;
+#else
+constexpr std::size_t default_metrics_slots = 0;
+#endif
+
+// Adaptive spin-then-sleep: the spin budget grows while spinning pays off
+// and shrinks whenever we end up parking on the futex anyway.
+class adaptive_waiter {
+public:
+    template <typename Op>
+    bool wait_until(Op&& op, std::atomic<std::uint32_t>& word,
+                    std::atomic<std::uint32_t>& waiters, std::chrono::nanoseconds timeout) {
+        for (unsigned i = 0; i < spin_limit_; i++) {
+            if (op()) {
+                spin_limit_ = std::min(spin_limit_ * 2, max_spin);
+                return true;
+            }
+            cpu_relax();
+        }
+        spin_limit_ = std::max(spin_limit_ / 2, min_spin);
+
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (timeout != no_timeout)
+            deadline = std::chrono::steady_clock::now() + timeout;
+
+        for (;;) {
+            waiters.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto observed = word.load(std::memory_order_relaxed);
+
+            if (op()) {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            if (deadline == std::chrono::steady_clock::time_point::max()) {
+                futex_wait(&word, observed, nullptr);
+            } else {
+                auto left = deadline - std::chrono::steady_clock::now();
+                if (left <= std::chrono::nanoseconds::zero()) {
+                    waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return false;
+                }
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+                timespec ts { static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+                futex_wait(&word, observed, &ts);
+            }
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr unsigned min_spin = 16;
+    static constexpr unsigned max_spin = 4096;
+
+    unsigned spin_limit_ = max_spin / 4;
+};
+
+// Placement options for a segment. Attachers of a hugetlbfs-backed segment
+// must pass the same huge_pages/hugetlbfs_dir, since that is where the name lives.
+struct segment_options_t {
+    bool        huge_pages     = false;             // back the segment with hugetlbfs
+    std::string hugetlbfs_dir  = "/dev/hugepages";
+    std::size_t huge_page_size = 2 << 20;           // segment size is rounded up to this
+    int         numa_node      = -1;                // mbind the mapping to this node, -1 = default policy
+    bool        populate       = false;             // pre-fault the whole mapping up front
+
+    // Crash recovery for shm_mpmc_bounded_queue. The creator decides whether
+    // the segment gets a producer table; every handle then registers in it.
+    std::size_t robust_producers = 0;                   // producer table entries, 0 = off
+    std::chrono::nanoseconds recovery_timeout = std::chrono::milliseconds(10);  // stall before checking for dead producers
+
+    // Per-handle counters for shm_mpmc_bounded_queue, read by mpmc_stat. The
+    // table is only reserved by creators built with IPC_MPMC_METRICS, and
+    // only such builds update it.
+    std::size_t metrics_slots = default_metrics_slots;
+    bool        read_only     = false;              // map PROT_READ, never create (inspection tools)
+
+    // How long an attacher waits for a concurrent creator to size and
+    // initialize the segment before giving up.
+    std::chrono::nanoseconds attach_timeout = std::chrono::seconds(1);
+
+    // Pollable notification for shm_mpmc_bounded_queue consumers that run an
+    // event loop. The creator decides how many handles can listen at once;
+    // each listener owns a FIFO in notify_dir, which all handles must agree on.
+    std::size_t listener_slots = 0;
+    std::string notify_dir     = "/dev/shm";
+
+    // shm_growable_queue and shm_keyed_queue: handles that can be open at
+    // once (consumers only, for the keyed queue). Each one keeps what it is
+    // using in a table in the segment: blocks that must not be recycled,
+    // partitions that no other consumer may take.
+    std::size_t handle_slots = 64;
+};
+
+// A named POSIX shared-memory segment mapped into this process. Whoever
+// creates the object (O_EXCL, so there is exactly one) sizes it to `size` and
+// becomes its owner: it initializes the contents, publishes them with
+// publish_header(), and unlinks the name on destruction. Everybody else
+// attaches and calls await_header() before using the contents.
+class shm_segment {
+public:
+    shm_segment(const std::string& shm_name, bool create_segment, std::size_t size,
+                const segment_options_t& options = {})
+        : shm_name_(shm_name), fd_(-1), data_(nullptr), size_(0), owner_(false),
+          attach_deadline_(std::chrono::steady_clock::now() + options.attach_timeout)
+    {
+        bool read_only = options.read_only;
+        int  flags     = read_only ? O_RDONLY : O_RDWR;
+        if (options.huge_pages) {
+            path_ = options.hugetlbfs_dir + (shm_name_[0] == '/' ? "" : "/") + shm_name_;
+            size  = (size + options.huge_page_size - 1) / options.huge_page_size * options.huge_page_size;
+        }
+        auto open_fd = [&](int f) {
+            return options.huge_pages ? open(path_.c_str(), f, 0666) : shm_open(shm_name_.c_str(), f, 0666);
+        };
+
+        if (create_segment && !read_only) {
+            fd_ = open_fd(flags | O_CREAT | O_EXCL);
+            if (fd_ >= 0)           owner_ = true;
+            else if (errno == EEXIST) fd_ = open_fd(flags);
+        } else {
+            fd_ = open_fd(flags);
+        }
+
+        if (fd_ < 0) throw std::runtime_error(options.huge_pages ? "open on hugetlbfs failed" : "shm_open failed");
+
+        if (owner_) {
+            size_ = size;
+            if (ftruncate(fd_, size_) != 0) fail("ftruncate failed");
+        } else {
+            // the creator may not have sized the object yet
+            struct stat st {};
+            while (fstat(fd_, &st) == 0 && st.st_size == 0) {
+                if (std::chrono::steady_clock::now() >= attach_deadline_)
+                    fail("segment exists but its creator never sized it");
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            size_ = st.st_size;
+        }
+
+        // Pages must not be faulted in before mbind(), so MAP_POPULATE is only
+        // used when no node is requested.
+        bool bind     = options.numa_node >= 0;
+        int  map_flags = MAP_SHARED | (options.populate && !bind ? MAP_POPULATE : 0);
+        void* p = mmap(nullptr, size_, PROT_READ | (read_only ? 0 : PROT_WRITE), map_flags, fd_, 0);
+        if (p == MAP_FAILED) fail("mmap failed");
+        data_ = p;
+
+        if (bind) {
+            unsigned long nodemask[16] = {};
+            std::size_t   bits = sizeof(nodemask) * CHAR_BIT;
+            if (static_cast<std::size_t>(options.numa_node) >= bits) fail("numa node out of range");
+            nodemask[options.numa_node / (sizeof(unsigned long) * CHAR_BIT)] |=
+                1ul << (options.numa_node % (sizeof(unsigned long) * CHAR_BIT));
+            if (syscall(SYS_mbind, data_, size_, MPOL_BIND, nodemask, bits + 1, MPOL_MF_MOVE) != 0)
+                fail("mbind failed");
+            if (options.populate) prefault();
+        }
+    }
+
+    ~shm_segment() {
+        close_segment();
+    }
+
+    void*              data()    const { return data_; }
+    std::size_t        size()    const { return size_; }
+    bool               created() const { return owner_; }
+    const std::string& name()    const { return shm_name_; }
+
+    // Creator: marks the segment initialized. Everything written before
+    // this call is visible to attachers once await_header() returns.
+    void publish_header(segment_header_t& h) const {
+        h.magic      = segment_magic;
+        h.version    = segment_version;
+        h.cache_line = std::hardware_destructive_interference_size;
+        h.state.store(segment_ready, std::memory_order_release);
+    }
+
+    // Attacher: waits (up to attach_timeout) until the creator has published
+    // the segment, then checks that it was written by a compatible build.
+    void await_header(const segment_header_t& h) const {
+        if (size_ < sizeof(segment_header_t))
+            throw std::runtime_error(shm_name_ + ": segment is too small to hold a header");
+        while (h.state.load(std::memory_order_acquire) != segment_ready) {
+            if (std::chrono::steady_clock::now() >= attach_deadline_)
+                throw std::runtime_error(shm_name_ + ": segment was not initialized in time");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (h.magic != segment_magic)
+            throw std::runtime_error(shm_name_ + ": not a queue segment (bad magic)");
+        if (h.version != segment_version)
+            throw std::runtime_error(shm_name_ + ": segment version " + std::to_string(h.version) +
+                                     ", this build uses version " + std::to_string(segment_version));
+        check_field(h.cache_line, std::hardware_destructive_interference_size, "cache line size");
+    }
+
+    // Attacher: throws a readable error if a header field differs from what
+    // this handle was compiled for.
+    void check_field(std::size_t in_segment, std::size_t expected, const char* what) const {
+        if (in_segment != expected)
+            throw std::runtime_error(shm_name_ + ": " + what + " mismatch, segment has " +
+                                     std::to_string(in_segment) + ", this handle expects " +
+                                     std::to_string(expected));
+    }
+
+private:
+    std::string shm_name_;
+    std::string path_;          // set when the segment lives on hugetlbfs
+    int         fd_;
+    void*       data_;
+    std::size_t size_;
+    bool        owner_;
+    std::chrono::steady_clock::time_point attach_deadline_;
+
+    shm_segment(shm_segment const&) = delete;
+    void operator=(shm_segment const&) = delete;
+
+    // Faults every page in under the current memory policy. Falls back to
+    // touching the pages on kernels without MADV_POPULATE_WRITE (< 5.14); the
+    // creator writes (nobody else uses the segment yet), attachers only read.
+    void prefault() {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(data_, size_, MADV_POPULATE_WRITE) == 0) return;
+#endif
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto* p   = static_cast<volatile char*>(data_);
+        for (std::size_t off = 0; off < size_; off += page) {
+            if (owner_) p[off] = 0;
+            else        (void)p[off];
+        }
+    }
+
+    void close_segment() {
+        if (data_) munmap(data_, size_);
+        if (fd_ >= 0) close(fd_);
+        if (owner_) {
+            if (path_.empty()) shm_unlink(shm_name_.c_str());
+            else               unlink(path_.c_str());
+        }
+        data_ = nullptr;
+        fd_   = -1;
+    }
+
+    [[noreturn]] void fail(const char* what) {
+        close_segment();
+        throw std::runtime_error(what);
+    }
+};
@@ -0,0 +1,79 @@
+// Log-linear latency histogram in the spirit of HdrHistogram.
+//
+// Values below 2^sub_bits are counted exactly; above that every power-of-two
+// range is split into 2^(sub_bits-1) equal buckets, which keeps the relative
+// error under 1% for sub_bits = 8. The counters are a plain array, so a
+// histogram can be placed in shared memory and filled by another process.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+class latency_histogram {
+public:
+    static constexpr int         sub_bits     = 8;
+    static constexpr std::size_t sub_count    = std::size_t(1) << sub_bits;
+    static constexpr std::size_t half_count   = sub_count / 2;
+    static constexpr std::size_t bucket_count = sub_count + (64 - sub_bits) * half_count;
+
+    void record(std::uint64_t v) {
+        counts_[index(v)]++;
+        total_++;
+        sum_ += v;
+        max_ = std::max(max_, v);
+        min_ = std::min(min_, v);
+    }
+
+    void merge(const latency_histogram& o) {
+        for (std::size_t i = 0; i < bucket_count; i++) counts_[i] += o.counts_[i];
+        total_ += o.total_;
+        sum_   += o.sum_;
+        max_    = std::max(max_, o.max_);
+        min_    = std::min(min_, o.min_);
+    }
+
+    void reset() { *this = latency_histogram(); }
+
+    std::uint64_t count() const { return total_; }
+    std::uint64_t max()   const { return max_; }
+    std::uint64_t min()   const { return total_ ? min_ : 0; }
+    double        mean()  const { return total_ ? static_cast<double>(sum_) / total_ : 0.0; }
+
+    // Smallest recorded value v such that at least `p` (0..1) of the samples
+    // are <= v, reported as the upper edge of its bucket.
+    std::uint64_t percentile(double p) const {
+        if (total_ == 0) return 0;
+        auto target = static_cast<std::uint64_t>(p * total_ + 0.5);
+        if (target == 0) target = 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; i++) {
+            seen += counts_[i];
+            if (seen >= target) return std::min(upper_bound(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    std::uint64_t counts_[bucket_count] = {};
+    std::uint64_t total_ = 0;
+    std::uint64_t sum_   = 0;
+    std::uint64_t max_   = 0;
+    std::uint64_t min_   = UINT64_MAX;
+
+    static std::size_t index(std::uint64_t v) {
+        if (v < sub_count) return static_cast<std::size_t>(v);
+        int msb   = 63 - __builtin_clzll(v);
+        int shift = msb - sub_bits + 1;                     // >= 1
+        auto top  = static_cast<std::size_t>(v >> shift);   // in [half_count, sub_count)
+        return sub_count + (shift - 1) * half_count + (top - half_count);
+    }
+
+    static std::uint64_t upper_bound(std::size_t i) {
+        if (i < sub_count) return i;
+        auto shift = (i - sub_count) / half_count + 1;
+        auto top   = (i - sub_count) % half_count + half_count;
+        return ((static_cast<std::uint64_t>(top) + 1) << shift) - 1;
+    }
+};
@@ -0,0 +1,142 @@
+// vmstat-like monitor for a live shm_mpmc_bounded_queue segment.
+//
+//   mpmc_stat [-p] <shm name> [interval ms [count]]
+//
+// Attaches read-only and prints the queue depth and enqueue/dequeue rates
+// every interval. If the creator was built with IPC_MPMC_METRICS the segment
+// also carries per-handle counters, which add full/empty/retry rates and,
+// with -p, a per-handle breakdown.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include "ipc_mpmc.h"
+
+struct queue_totals_t {
+    std::uint64_t enqueued = 0, dequeued = 0, full = 0, empty = 0, retries = 0, max_depth = 0;
+};
+
+// Name of a bounded queue's cell layout, nullptr for any other segment.
+// Sharded, priority, growable, keyed, journal and directory segments set a
+// flag above 0x1ff in their layout id, so they are rejected here too.
+const char* layout_name(std::size_t id) {
+    if (id & ~std::size_t(0x1ff)) return nullptr;
+    switch (id & 0xff) {
+    case padded_cells::id: return id & 0x100 ? "scrambled<padded>" : "padded";
+    case packed_cells::id: return id & 0x100 ? "scrambled<packed>" : "packed";
+    case split_cells::id:  return id & 0x100 ? "scrambled<split>"  : "split";
+    }
+    return nullptr;
+}
+
+queue_totals_t read_totals(queue_data_t* q) {
+    queue_totals_t t;
+    t.enqueued = q->enqueue_pos.load(std::memory_order_relaxed);
+    t.dequeued = q->dequeue_pos.load(std::memory_order_relaxed);
+
+    auto* table = metrics_table(q);
+    for (std::size_t i = 0; i < q->metrics_slots; i++) {
+        auto& m = table[i];
+        if (m.pid.load(std::memory_order_acquire) == 0) continue;
+        t.full      += m.full.load(std::memory_order_relaxed);
+        t.empty     += m.empty.load(std::memory_order_relaxed);
+        t.retries   += m.enqueue_retries.load(std::memory_order_relaxed) +
+                       m.dequeue_retries.load(std::memory_order_relaxed);
+        t.max_depth  = std::max<std::uint64_t>(t.max_depth, m.max_depth.load(std::memory_order_relaxed));
+    }
+    return t;
+}
+
+void print_handles(queue_data_t* q) {
+    auto* table = metrics_table(q);
+    std::printf("  %8s %12s %12s %10s %10s %10s %10s %9s\n",
+                "pid", "enqueued", "dequeued", "full", "empty", "enq_retry", "deq_retry", "max_depth");
+    for (std::size_t i = 0; i < q->metrics_slots; i++) {
+        auto& m   = table[i];
+        auto  pid = m.pid.load(std::memory_order_acquire);
+        if (pid == 0 || (pid < 0 && i > 0)) continue;     // free, or being registered or reaped
+        char who[16];
+        if (i == 0)  std::snprintf(who, sizeof(who), "closed");
+        else         std::snprintf(who, sizeof(who), "%d", pid);
+        std::printf("  %8s %12lu %12lu %10lu %10lu %10lu %10lu %9lu\n", who,
+                    (unsigned long)m.enqueued.load(std::memory_order_relaxed),
+                    (unsigned long)m.dequeued.load(std::memory_order_relaxed),
+                    (unsigned long)m.full.load(std::memory_order_relaxed),
+                    (unsigned long)m.empty.load(std::memory_order_relaxed),
+                    (unsigned long)m.enqueue_retries.load(std::memory_order_relaxed),
+                    (unsigned long)m.dequeue_retries.load(std::memory_order_relaxed),
+                    (unsigned long)m.max_depth.load(std::memory_order_relaxed));
+    }
+}
+
+int main(int argc, char** argv) {
+    bool per_handle = false;
+    int  arg        = 1;
+    if (arg < argc && std::strcmp(argv[arg], "-p") == 0) {
+        per_handle = true;
+        arg++;
+    }
+    if (arg >= argc) {
+        std::fprintf(stderr, "usage: %s [-p] <shm name> [interval ms [count]]\n", argv[0]);
+        return 2;
+    }
+    std::string name     = argv[arg++];
+    int         interval = arg < argc ? std::atoi(argv[arg++]) : 1000;
+    long        count    = arg < argc ? std::atol(argv[arg++]) : -1;
+
+    segment_options_t options;
+    options.read_only = true;
+
+    try {
+        shm_segment segment(name, false, 0, options);
+        auto* q = static_cast<queue_data_t*>(segment.data());
+        const auto& h = q->header;
+        segment.await_header(h);
+
+        const char* layout = layout_name(h.layout);
+        if (segment.size() < sizeof(queue_data_t) || !layout ||
+            q->metrics_offset + q->metrics_slots * sizeof(queue_metrics_t) > segment.size()) {
+            std::fprintf(stderr, "%s: not a bounded queue (layout %#zx)\n", name.c_str(), h.layout);
+            return 1;
+        }
+
+        std::printf("%s: capacity %zu, payload %zu B, cell %zu B, layout %s, %s\n",
+                    name.c_str(), h.capacity, h.payload_size, h.cell_size, layout,
+                    q->metrics_slots ? "metrics on" : "metrics off (build the creator with IPC_MPMC_METRICS)");
+
+        auto prev = read_totals(q);
+        auto then = std::chrono::steady_clock::now();
+        for (long i = 0; count < 0 || i < count; i++) {
+            if (i % 20 == 0)
+                std::printf("%10s %10s %12s %12s %10s %10s %10s %9s %9s\n",
+                            "depth", "max_depth", "enq/s", "deq/s", "full/s", "empty/s", "retry/s",
+                            "abandoned", "recovered");
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+            auto now  = std::chrono::steady_clock::now();
+            auto cur  = read_totals(q);
+            double dt = std::chrono::duration<double>(now - then).count();
+            auto rate = [dt](std::uint64_t a, std::uint64_t b) { return b >= a ? (b - a) / dt : 0.0; };
+
+            std::printf("%10lu %10lu %12.0f %12.0f %10.0f %10.0f %10.0f %9zu %9zu\n",
+                        (unsigned long)(cur.enqueued >= cur.dequeued ? cur.enqueued - cur.dequeued : 0),
+                        (unsigned long)cur.max_depth,
+                        rate(prev.enqueued, cur.enqueued), rate(prev.dequeued, cur.dequeued),
+                        rate(prev.full, cur.full), rate(prev.empty, cur.empty), rate(prev.retries, cur.retries),
+                        q->abandoned.load(std::memory_order_relaxed),
+                        q->recovered.load(std::memory_order_relaxed));
+            if (per_handle && q->metrics_slots) print_handles(q);
+            std::fflush(stdout);
+
+            prev = cur;
+            then = now;
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", name.c_str(), e.what());
+        return 1;
+    }
+    return 0;
+}
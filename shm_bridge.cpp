@@ -0,0 +1,285 @@
+// Bridge daemon: carries the messages of a shm_mpmc_bounded_queue to a queue
+// of the same name and type on another host, see ipc_bridge.h.
+//
+//   shm_bridge send <shm name> <host>:<port> [options]    drains the local queue
+//   shm_bridge recv <shm name> <port> [options]           fills the local queue
+//
+// The payload type is not known here, so the queue is bridged as opaque
+// 8-byte aligned messages of the size in its segment header: 8, 16, 32, ...
+// 4096 bytes (the ipc_benchmark messages, for example). If the queue does not
+// exist yet the bridge creates it from --payload/--capacity/--layout, and
+// removes it again on exit. For other payload types, build a bridge with
+// shm_tcp_sender/shm_tcp_receiver and the real type.
+//
+// The sender reconnects until it is stopped and carries the sequence numbers
+// on, the receiver accepts one connection after the other; gaps between
+// connections are reported as lost messages.
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include "ipc_mpmc.h"
+#include "ipc_bridge.h"
+
+struct bridge_config_t {
+    std::string      role;                  // "send" or "recv"
+    std::string      queue;
+    std::string      host;                  // send: where the receiver listens
+    std::string      port;
+    std::size_t      payload  = 64;         // used only when the bridge creates the queue
+    std::size_t      capacity = 65536;
+    std::string      layout   = "padded";
+    bridge_options_t options;
+};
+
+// Opaque message of the queue's payload size.
+template <std::size_t Size>
+struct bridge_message_t {
+    alignas(8) unsigned char bytes[Size];
+};
+
+bridge_config_t   config;
+std::atomic<bool> stop { false };
+std::atomic<int>  interrupt_fds[2] = { -1, -1 };    // receiver: listening and accepted socket
+
+// Stops the bridge. A receiver blocked in accept() or read() is woken by
+// shutting its sockets down; a sender notices the flag within idle_wait and
+// still flushes its batch.
+extern "C" void on_signal(int) {
+    stop.store(true);
+    for (auto& fd : interrupt_fds) {
+        int f = fd.load();
+        if (f >= 0) shutdown(f, SHUT_RDWR);
+    }
+}
+
+void log_stats(const char* what, const bridge_stats_t& s) {
+    std::cerr << "shm_bridge: " << what << ": " << s.messages << " msgs in " << s.frames << " frames ("
+              << (s.frames ? static_cast<double>(s.messages) / s.frames : 0) << " per frame), " << s.bytes
+              << " bytes";
+    if (s.gaps) std::cerr << ", " << s.gaps << " gaps, " << s.lost << " lost";
+    std::cerr << "\n";
+}
+
+int connect_to(const std::string& host, const std::string& port) {
+    addrinfo hints {}, *res = nullptr;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res); err != 0)
+        throw std::runtime_error(host + ": " + gai_strerror(err));
+    int fd = -1;
+    for (auto* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int listen_on(const std::string& port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket failed");
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 addr {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr   = in6addr_any;
+    addr.sin6_port   = htons(static_cast<std::uint16_t>(std::stoi(port)));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "cannot listen on port " + port);
+    }
+    return fd;
+}
+
+template <typename Queue, typename Message>
+void send(Queue& q) {
+    std::uint64_t  next_seq = 0;
+    bridge_stats_t total;
+    while (!stop.load()) {
+        int fd = connect_to(config.host, config.port);
+        if (fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        std::cerr << "shm_bridge: connected to " << config.host << ":" << config.port << "\n";
+        auto options      = config.options;
+        options.first_seq = next_seq;
+        try {
+            shm_tcp_sender<Queue, Message> tx(q, fd, options);
+            try {
+                tx.run(stop);
+            } catch (const std::exception& e) {
+                std::cerr << "shm_bridge: " << e.what() << ", reconnecting\n";
+            }
+            next_seq = tx.next_seq();
+            log_stats("sent", tx.stats());
+            total.messages += tx.stats().messages;
+        } catch (const std::exception& e) {
+            std::cerr << "shm_bridge: " << e.what() << ", reconnecting\n";
+        }
+    }
+    std::cerr << "shm_bridge: " << total.messages << " msgs sent in total\n";
+}
+
+template <typename Queue, typename Message>
+void receive(Queue& q) {
+    using receiver_t = shm_tcp_receiver<Queue, Message>;
+    int listen_fd = listen_on(config.port);
+    interrupt_fds[0] = listen_fd;
+    std::uint64_t expected = receiver_t::any_seq;
+    while (!stop.load()) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || stop.load()) continue;
+            throw std::system_error(errno, std::generic_category(), "accept failed");
+        }
+        interrupt_fds[1] = fd;
+        try {
+            receiver_t rx(q, fd, expected);
+            try {
+                rx.run(stop);
+            } catch (const std::exception& e) {
+                std::cerr << "shm_bridge: " << e.what() << "\n";
+            }
+            expected = rx.expected_seq();
+            log_stats("received", rx.stats());
+        } catch (const std::exception& e) {
+            std::cerr << "shm_bridge: " << e.what() << "\n";
+        }
+        interrupt_fds[1] = -1;
+    }
+    interrupt_fds[0] = -1;
+    close(listen_fd);
+}
+
+template <typename Message, typename Layout>
+void run() {
+    using queue_t = shm_mpmc_bounded_queue<Message, Layout>;
+    queue_t q(config.queue, config.capacity, true);
+    if (config.role == "send") send<queue_t, Message>(q);
+    else                       receive<queue_t, Message>(q);
+}
+
+template <typename Message>
+void run_layout() {
+    if (config.layout == "packed") return run<Message, packed_cells>();
+    if (config.layout == "split")  return run<Message, split_cells>();
+    if (config.layout == "padded") return run<Message, padded_cells>();
+    throw std::invalid_argument("unknown layout: " + config.layout);
+}
+
+void run_payload() {
+    switch (config.payload) {
+    case 8:    return run_layout<bridge_message_t<8>>();
+    case 16:   return run_layout<bridge_message_t<16>>();
+    case 32:   return run_layout<bridge_message_t<32>>();
+    case 64:   return run_layout<bridge_message_t<64>>();
+    case 128:  return run_layout<bridge_message_t<128>>();
+    case 256:  return run_layout<bridge_message_t<256>>();
+    case 512:  return run_layout<bridge_message_t<512>>();
+    case 1024: return run_layout<bridge_message_t<1024>>();
+    case 2048: return run_layout<bridge_message_t<2048>>();
+    case 4096: return run_layout<bridge_message_t<4096>>();
+    }
+    throw std::invalid_argument("payload must be a power of 2 between 8 and 4096 bytes");
+}
+
+// Takes payload size and layout from the queue if it exists already.
+void inspect_queue() {
+    segment_options_t options;
+    options.read_only = true;
+    std::unique_ptr<shm_segment> segment;
+    try {
+        segment = std::make_unique<shm_segment>(config.queue, false, 0, options);
+    } catch (const std::exception&) {
+        return;                                 // does not exist, the bridge creates it
+    }
+    const auto& h = static_cast<queue_data_t*>(segment->data())->header;
+    segment->await_header(h);
+    if (h.payload_align != 8)
+        throw std::runtime_error(config.queue + ": payload alignment " + std::to_string(h.payload_align) +
+                                 ", shm_bridge handles 8-byte aligned payloads only");
+    config.payload = h.payload_size;
+    switch (h.layout) {
+    case padded_cells::id: config.layout = "padded"; break;
+    case packed_cells::id: config.layout = "packed"; break;
+    case split_cells::id:  config.layout = "split";  break;
+    default: throw std::runtime_error(config.queue + ": not a shm_mpmc_bounded_queue with a plain layout");
+    }
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " send <shm name> <host>:<port> [options]\n"
+              << "       " << argv0 << " recv <shm name> <port> [options]\n"
+              << "  --batch N                  messages per frame (default 256)\n"
+              << "  --delay US                 max time a message waits for its batch to fill (default 20)\n"
+              << "  --payload BYTES            payload size if the queue does not exist (default 64)\n"
+              << "  --capacity N               capacity if the queue does not exist (default 65536)\n"
+              << "  --layout padded|packed|split\n";
+    std::exit(2);
+}
+
+void parse_args(int argc, char** argv) {
+    if (argc < 4) usage(argv[0]);
+    config.role  = argv[1];
+    config.queue = argv[2];
+    std::string where = argv[3];
+    if (config.role == "send") {
+        auto colon = where.rfind(':');
+        if (colon == std::string::npos) usage(argv[0]);
+        config.host = where.substr(0, colon);
+        config.port = where.substr(colon + 1);
+    } else if (config.role == "recv") {
+        config.port = where;
+    } else {
+        usage(argv[0]);
+    }
+
+    for (int i = 4; i < argc; i++) {
+        std::string key = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        std::string val = argv[++i];
+
+        if      (key == "--batch")    config.options.max_batch = std::stoull(val);
+        else if (key == "--delay")    config.options.max_delay = std::chrono::microseconds(std::stoll(val));
+        else if (key == "--payload")  config.payload  = std::stoull(val);
+        else if (key == "--capacity") config.capacity = std::stoull(val);
+        else if (key == "--layout")   config.layout   = val;
+        else usage(argv[0]);
+    }
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+
+    struct sigaction sa {};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        inspect_queue();
+        run_payload();
+    } catch (const std::exception& e) {
+        std::cerr << "shm_bridge: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
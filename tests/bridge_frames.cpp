@@ -0,0 +1,108 @@
+// Loopback test for the TCP bridge: a sender and a receiver exchange frames
+// over 127.0.0.1, then hand-written connections that close in the middle of
+// a frame must make the receiver throw without enqueuing anything.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. bridge_frames.cpp -o bridge_frames
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "ipc_mpmc.h"
+#include "ipc_bridge.h"
+
+constexpr const char* name = "/mpmc_test_bridge";
+
+#define check(cond, ...) \
+    do { if (!(cond)) { std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                        std::fprintf(stderr, __VA_ARGS__); std::fputc('\n', stderr); std::exit(1); } } while (0)
+
+using queue_t    = shm_mpmc_bounded_queue<std::uint64_t>;
+using sender_t   = shm_tcp_sender<queue_t, std::uint64_t>;
+using receiver_t = shm_tcp_receiver<queue_t, std::uint64_t>;
+
+// A connected pair of TCP sockets on the loopback interface.
+struct tcp_pair_t { int client, server; };
+
+tcp_pair_t loopback_pair() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    check(bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && listen(listener, 1) == 0 &&
+          getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) == 0, "cannot listen on loopback");
+
+    tcp_pair_t p;
+    p.client = socket(AF_INET, SOCK_STREAM, 0);
+    check(connect(p.client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0, "cannot connect");
+    p.server = accept(listener, nullptr, nullptr);
+    check(p.server >= 0, "cannot accept");
+    close(listener);
+    return p;
+}
+
+void send_bytes(int fd, const void* buf, std::size_t len) {
+    iovec iov { const_cast<void*>(buf), len };
+    bridge_writev(fd, &iov, 1);
+}
+
+void round_trip(queue_t& from, queue_t& to) {
+    auto p = loopback_pair();
+    bridge_options_t options;
+    options.max_batch = 4;
+    sender_t   tx(from, p.client, options);
+    receiver_t rx(to, p.server);
+
+    for (std::uint64_t i = 0; i < 10; i++) check(from.enqueue(i), "enqueue %llu", (unsigned long long)i);
+    while (tx.poll()) {}
+    tx.flush();
+    while (rx.stats().messages < 10) check(rx.poll(), "sender went away early");
+
+    std::uint64_t v;
+    for (std::uint64_t i = 0; i < 10; i++)
+        check(to.dequeue(v) && v == i, "message %llu: got %llu", (unsigned long long)i, (unsigned long long)v);
+    check(!to.dequeue(v), "extra message %llu", (unsigned long long)v);
+}
+
+// Sends a hello, a frame header announcing 3 messages and `payloads` of
+// them, then closes. The receiver must throw and enqueue nothing.
+void truncated_frame(queue_t& to, std::size_t payloads) {
+    auto p = loopback_pair();
+    bridge_hello_t hello { bridge_magic, bridge_version, sizeof(std::uint64_t), alignof(std::uint64_t), 4 };
+    bridge_frame_t frame { bridge_magic, 3, 0 };
+    std::uint64_t  data[3] = { 7, 8, 9 };
+    send_bytes(p.client, &hello, sizeof(hello));
+    send_bytes(p.client, &frame, sizeof(frame));
+    if (payloads) send_bytes(p.client, data, payloads * sizeof(data[0]));
+    close(p.client);
+
+    receiver_t rx(to, p.server);
+    bool threw = false;
+    try {
+        rx.poll();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    std::uint64_t v;
+    check(threw, "frame cut after %zu payloads was accepted", payloads);
+    check(rx.stats().messages == 0, "%llu messages counted", (unsigned long long)rx.stats().messages);
+    check(!to.dequeue(v), "phantom message %llu enqueued", (unsigned long long)v);
+}
+
+int main() {
+    shm_unlink(name);                               // left over from a crashed run
+    std::string from_name = std::string(name) + "_from";
+    shm_unlink(from_name.c_str());
+    queue_t from(from_name, 64);
+    queue_t to(name, 64);
+
+    round_trip(from, to);
+    truncated_frame(to, 0);                         // closed right after the header
+    truncated_frame(to, 1);                         // closed inside the payloads
+
+    std::printf("ok\n");
+    return 0;
+}
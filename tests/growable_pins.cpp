@@ -0,0 +1,51 @@
+// Checks that one-sided handles of shm_growable_queue do not keep blocks out
+// of the pool: a producer-only and a consumer-only handle cycle more bursts
+// than the pool has blocks, after which the queue must still grow to every
+// block of the pool.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. growable_pins.cpp -o growable_pins
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include "ipc_growable.h"
+
+constexpr const char* name           = "/mpmc_test_growable";
+constexpr std::size_t block_capacity = 8;
+constexpr std::size_t blocks         = 4;
+
+#define check(cond, ...) \
+    do { if (!(cond)) { std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                        std::fprintf(stderr, __VA_ARGS__); std::fputc('\n', stderr); std::exit(1); } } while (0)
+
+using queue_t = shm_growable_queue<std::uint64_t>;
+
+int main() {
+    shm_unlink(name);                               // left over from a crashed run
+    const std::size_t memory_cap = blocks * queue_t::block_bytes(block_capacity);
+    queue_t producer(name, block_capacity, memory_cap);
+    queue_t consumer(name, block_capacity, memory_cap, false);
+    check(producer.max_blocks() == blocks, "pool has %zu blocks", producer.max_blocks());
+
+    // Every burst spans three blocks, so blocks keep being retired and reused.
+    std::uint64_t next_in = 0, next_out = 0;
+    for (std::size_t burst = 0; burst < 4 * blocks; burst++) {
+        for (std::size_t i = 0; i < 2 * block_capacity + 1; i++)
+            check(producer.enqueue(next_in++), "burst %zu: enqueue %zu failed", burst, i);
+        std::uint64_t v;
+        while (consumer.dequeue(v))
+            check(v == next_out++, "burst %zu: got %llu", burst, (unsigned long long)v);
+        check(next_out == next_in, "burst %zu: %llu messages left", burst,
+              (unsigned long long)(next_in - next_out));
+    }
+
+    // Empty again: the whole pool must be available.
+    std::size_t n = 0;
+    while (producer.enqueue(n)) n++;
+    check(n == blocks * block_capacity, "queue filled up after %zu of %zu messages", n, blocks * block_capacity);
+    check(producer.blocks_in_use() == blocks, "%zu of %zu blocks in use", producer.blocks_in_use(), blocks);
+
+    std::printf("ok\n");
+    return 0;
+}
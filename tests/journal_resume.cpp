@@ -0,0 +1,82 @@
+// Multi-producer resume test for shm_journaled_queue: producers race, so
+// messages reach the consumer out of sequence order. The consumer commits
+// each one, "crashes" halfway, and a restarted consumer resumes from its
+// cursor. Nothing may be lost, and the cursor may never move backwards.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. journal_resume.cpp -o journal_resume
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include "ipc_journal.h"
+
+constexpr const char*   name      = "/mpmc_test_journal";
+constexpr const char*   dir       = "/tmp/mpmc_test_journal";
+constexpr int           producers = 4;
+constexpr std::uint64_t messages  = 50'000;       // per producer
+constexpr std::uint64_t total     = producers * messages;
+
+#define check(cond, ...) \
+    do { if (!(cond)) { std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                        std::fprintf(stderr, __VA_ARGS__); std::fputc('\n', stderr); std::exit(1); } } while (0)
+
+using queue_t = shm_journaled_queue<std::uint64_t>;
+
+int main() {
+    shm_unlink(name);                               // left over from a crashed run
+    std::filesystem::remove_all(dir);
+
+    std::vector<bool> handled(total);
+    std::uint64_t     out_of_order = 0;
+    {
+        queue_t q(name, dir, 1 << 18);
+        journal_cursor cursor(dir, "test");
+
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++)
+            threads.emplace_back([p] {
+                queue_t q(name, dir, 1 << 18, false);
+                for (std::uint64_t i = 0; i < messages; i++)
+                    check(q.enqueue(p * messages + i), "producer %d: enqueue %llu", p, (unsigned long long)i);
+            });
+
+        // Handle half of the messages, then stop as if the consumer crashed.
+        std::uint64_t seq, v, last = 0, n = 0;
+        while (n < total / 2) {
+            if (!q.dequeue(v, &seq)) continue;
+            out_of_order += n && seq < last;
+            last = seq;
+            handled[seq] = true;
+            auto before = cursor.next();
+            cursor.commit(seq);
+            check(cursor.next() >= before, "cursor moved back from %llu to %llu",
+                  (unsigned long long)before, (unsigned long long)cursor.next());
+            n++;
+        }
+        for (auto& t : threads) t.join();
+        for (std::uint64_t s = 0; s < cursor.next(); s++)
+            check(handled[s], "cursor at %llu, but %llu was never handled",
+                  (unsigned long long)cursor.next(), (unsigned long long)s);
+    }
+
+    // Restart: the ring is gone, the journal and the cursor are not.
+    queue_t q(name, dir, 1 << 18);
+    journal_cursor cursor(dir, "test");
+    auto end = q.resume(cursor.next(), [&](std::uint64_t seq, const std::uint64_t&) {
+        handled[seq] = true;
+        cursor.commit(seq);
+    });
+    cursor.skip_to(end);
+    check(end == total, "journal holds %llu of %llu messages", (unsigned long long)end, (unsigned long long)total);
+    check(cursor.next() == total, "cursor at %llu after resume", (unsigned long long)cursor.next());
+    for (std::uint64_t s = 0; s < total; s++)
+        check(handled[s], "message %llu lost", (unsigned long long)s);
+
+    std::filesystem::remove_all(dir);
+    std::printf("ok, %llu messages arrived out of order\n", (unsigned long long)out_of_order);
+    return 0;
+}
@@ -0,0 +1,590 @@
+// One driver for comparing transports on identical workloads: a publisher
+// sends `--messages` fixed-size messages, optionally paced, to `--fanout`
+// subscribers, and every subscriber records the end-to-end latency of every
+// message. Each (transport, payload, fanout) combination is one run and one
+// row of the CSV or JSON report.
+//
+// Transports: shm-queue (one shm_mpmc_bounded_queue per subscriber),
+// shm-broadcast (one shm_broadcast_ring for all), pipe and uds (one
+// pipe/socketpair per subscriber), and, when built with -DWITH_ZMQ,
+// zmq-ipc, zmq-tcp and zmq-inproc (PUB/SUB), and with -DWITH_HIREDIS,
+// redis (PUBLISH/SUBSCRIBE against a local server).
+//
+// Subscribers are separate processes, except for zmq-inproc, which only
+// works between threads of one context. Messages are raw bytes everywhere:
+// an 8-byte send timestamp and an 8-byte sequence number, padded to the
+// payload size.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef WITH_ZMQ
+#include <zmq.hpp>
+#endif
+#ifdef WITH_HIREDIS
+#include <hiredis/hiredis.h>
+#endif
+#include "../ipc_mpmc.h"
+#include "../ipc_broadcast.h"
+#include "../latency_histogram.h"
+
+constexpr int           max_fanout     = 64;
+constexpr std::uint64_t warmup_seq     = ~std::uint64_t(0);
+constexpr int           idle_timeout_ms = 1000;     // subscribers give up this long after the publisher is done
+
+struct bench_config_t {
+    std::vector<std::string> transports { "shm-queue", "shm-broadcast", "pipe", "uds" };
+    std::vector<size_t>      payloads   { 64 };
+    std::vector<int>         fanouts    { 1 };
+    size_t      messages = 1'000'000;
+    double      rate     = 0;               // msgs/sec sent by the publisher, 0 = as fast as possible
+    std::string format   = "csv";
+    std::string redis_host = "127.0.0.1";
+    int         redis_port = 6379;
+};
+
+// Parameters of one run.
+struct run_t {
+    std::string transport;
+    size_t      payload;
+    int         fanout;
+};
+
+struct message_header_t {
+    std::uint64_t sent;
+    std::uint64_t seq;
+};
+
+struct subscriber_stats_t {
+    std::uint64_t     received;
+    std::uint64_t     last_ns;              // steady clock of the last message
+    latency_histogram latency;
+};
+
+// Shared between the publisher and the subscribers of a run: an anonymous
+// MAP_SHARED mapping, inherited across fork().
+struct bench_shared_t {
+    std::atomic<int>    ready;              // subscribers that have seen a warm-up message
+    std::atomic<bool>   done;               // publisher has sent everything
+    subscriber_stats_t  subscribers[max_fanout];
+};
+
+struct result_t {
+    run_t         run;
+    double        send_rate;                // messages/sec the publisher got out
+    double        delivery_rate;            // messages/sec received, summed over subscribers
+    std::uint64_t lost;
+    latency_histogram latency;
+};
+
+bench_config_t config;
+
+std::uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Reads exactly `len` bytes from a stream fd, waiting at most `timeout_ms`
+// for the first one.
+bool read_full(int fd, char* buf, size_t len, int timeout_ms) {
+    pollfd p { fd, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) <= 0) return false;
+    for (size_t got = 0; got < len; ) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0) return false;
+        got += n;
+    }
+    return true;
+}
+
+void write_full(int fd, const char* buf, size_t len) {
+    for (size_t put = 0; put < len; ) {
+        ssize_t n = write(fd, buf + put, len - put);
+        if (n <= 0) throw std::runtime_error("write failed");
+        put += n;
+    }
+}
+
+// Every transport has the same shape. The transport object is built in the
+// parent before the subscribers start and owns whatever they inherit or
+// attach to by name; publisher and subscriber are built where they run.
+
+template <size_t Size>
+struct shm_message_t {
+    char bytes[Size];
+};
+
+template <size_t Size>
+struct shm_queue_transport {
+    using queue_t = shm_mpmc_bounded_queue<shm_message_t<Size>, padded_cells, spsc_t>;
+    static constexpr bool threads_only = false;
+
+    std::vector<std::unique_ptr<queue_t>> queues;
+
+    explicit shm_queue_transport(const run_t& r) {
+        for (int i = 0; i < r.fanout; i++)
+            queues.emplace_back(new queue_t(name(i), 1 << 16));
+    }
+
+    static std::string name(int i) { return "/transport_bench_q" + std::to_string(i); }
+
+    struct publisher {
+        shm_queue_transport& t;
+        publisher(shm_queue_transport& t, const run_t&) : t(t) {}
+        void send(const char* msg, size_t) {
+            shm_message_t<Size> m;
+            std::memcpy(m.bytes, msg, Size);
+            for (auto& q : t.queues) while (!q->enqueue(m)) cpu_relax();
+        }
+    };
+
+    struct subscriber {
+        queue_t q;
+        subscriber(shm_queue_transport&, const run_t&, int id) : q(name(id), 1 << 16, false) {}
+        bool receive(char* buf, size_t, int timeout_ms) {
+            shm_message_t<Size> m;
+            if (!q.dequeue_wait(m, std::chrono::milliseconds(timeout_ms))) return false;
+            std::memcpy(buf, m.bytes, Size);
+            return true;
+        }
+    };
+};
+
+template <size_t Size>
+struct shm_broadcast_transport {
+    using ring_t = shm_broadcast_ring<shm_message_t<Size>>;
+    static constexpr bool threads_only = false;
+
+    ring_t ring;
+
+    explicit shm_broadcast_transport(const run_t&) : ring("/transport_bench_ring", 1 << 16) {}
+
+    struct publisher {
+        shm_broadcast_transport& t;
+        publisher(shm_broadcast_transport& t, const run_t&) : t(t) {}
+        void send(const char* msg, size_t) {
+            shm_message_t<Size> m;
+            std::memcpy(m.bytes, msg, Size);
+            while (!t.ring.publish(m)) cpu_relax();
+        }
+    };
+
+    struct subscriber {
+        ring_t                       ring;
+        typename ring_t::subscription sub;
+        subscriber(shm_broadcast_transport&, const run_t&, int)
+            : ring("/transport_bench_ring", 1 << 16, broadcast_policy_t::gating, default_broadcast_subscribers, false),
+              sub(ring.subscribe()) {}
+        bool receive(char* buf, size_t, int timeout_ms) {
+            shm_message_t<Size> m;
+            if (!sub.receive_wait(m, std::chrono::milliseconds(timeout_ms))) return false;
+            std::memcpy(buf, m.bytes, Size);
+            return true;
+        }
+    };
+};
+
+// pipe and uds differ only in how the fd pairs are made.
+template <bool Socket>
+struct fd_transport {
+    static constexpr bool threads_only = false;
+
+    std::vector<std::pair<int, int>> fds;   // read end, write end
+
+    explicit fd_transport(const run_t& r) {
+        for (int i = 0; i < r.fanout; i++) {
+            int p[2];
+            if ((Socket ? socketpair(AF_UNIX, SOCK_STREAM, 0, p) : pipe(p)) != 0)
+                throw std::runtime_error("cannot create channel");
+            fds.emplace_back(p[0], p[1]);
+        }
+    }
+
+    ~fd_transport() {
+        for (auto [r, w] : fds) { close(r); close(w); }
+    }
+
+    struct publisher {
+        fd_transport& t;
+        publisher(fd_transport& t, const run_t&) : t(t) {}
+        void send(const char* msg, size_t len) {
+            for (auto [r, w] : t.fds) write_full(w, msg, len);
+        }
+    };
+
+    struct subscriber {
+        int fd;
+        subscriber(fd_transport& t, const run_t&, int id) : fd(t.fds[id].first) {}
+        bool receive(char* buf, size_t len, int timeout_ms) { return read_full(fd, buf, len, timeout_ms); }
+    };
+};
+
+#ifdef WITH_ZMQ
+// High-water marks are off, so PUB/SUB does not drop while a subscriber
+// catches up; messages it still loses show up in the `lost` column.
+struct zmq_transport {
+    static constexpr bool threads_only = false;
+
+    std::string endpoint;
+    std::optional<zmq::context_t> shared;   // inproc only: the context must be shared
+
+    zmq_transport(const run_t& r, std::string endpoint, bool inproc) : endpoint(std::move(endpoint)) {
+        if (inproc) shared.emplace(1);
+    }
+
+    struct publisher {
+        std::optional<zmq::context_t> own;
+        zmq::socket_t                 sock;
+        publisher(zmq_transport& t, const run_t&)
+            : own(t.shared ? std::nullopt : std::optional<zmq::context_t>(std::in_place, 1)),
+              sock(t.shared ? *t.shared : *own, ZMQ_PUB) {
+            sock.set(zmq::sockopt::sndhwm, 0);
+            sock.bind(t.endpoint);
+        }
+        void send(const char* msg, size_t len) { sock.send(zmq::const_buffer(msg, len), zmq::send_flags::none); }
+    };
+
+    struct subscriber {
+        std::optional<zmq::context_t> own;
+        zmq::socket_t                 sock;
+        subscriber(zmq_transport& t, const run_t&, int)
+            : own(t.shared ? std::nullopt : std::optional<zmq::context_t>(std::in_place, 1)),
+              sock(t.shared ? *t.shared : *own, ZMQ_SUB) {
+            sock.set(zmq::sockopt::rcvhwm, 0);
+            sock.set(zmq::sockopt::subscribe, "");
+            sock.connect(t.endpoint);
+        }
+        bool receive(char* buf, size_t len, int timeout_ms) {
+            sock.set(zmq::sockopt::rcvtimeo, timeout_ms);
+            auto n = sock.recv(zmq::mutable_buffer(buf, len), zmq::recv_flags::none);
+            return n && n->size == len;
+        }
+    };
+};
+
+template <int Kind>
+struct zmq_kind_transport : zmq_transport {
+    static constexpr bool threads_only = Kind == 2;
+    explicit zmq_kind_transport(const run_t& r)
+        : zmq_transport(r, Kind == 0 ? "ipc:///tmp/transport_bench.zmq"
+                         : Kind == 1 ? "tcp://127.0.0.1:5556"
+                                     : "inproc://transport_bench", Kind == 2) {}
+    using zmq_transport::publisher;
+    using zmq_transport::subscriber;
+};
+#endif
+
+#ifdef WITH_HIREDIS
+// Payloads are published as binary strings (%b), not as formatted numbers.
+struct redis_transport {
+    static constexpr bool threads_only = false;
+
+    explicit redis_transport(const run_t&) {}
+
+    static redisContext* connect() {
+        redisContext* c = redisConnect(config.redis_host.c_str(), config.redis_port);
+        if (!c || c->err) throw std::runtime_error("cannot connect to redis at " + config.redis_host);
+        return c;
+    }
+
+    struct publisher {
+        redisContext* c;
+        publisher(redis_transport&, const run_t&) : c(connect()) {}
+        ~publisher() { redisFree(c); }
+        void send(const char* msg, size_t len) {
+            auto* reply = static_cast<redisReply*>(redisCommand(c, "PUBLISH transport_bench %b", msg, len));
+            if (!reply) throw std::runtime_error("redis PUBLISH failed");
+            freeReplyObject(reply);
+        }
+    };
+
+    struct subscriber {
+        redisContext* c;
+        int           timeout_ms = -1;
+        subscriber(redis_transport&, const run_t&, int) : c(connect()) {
+            freeReplyObject(redisCommand(c, "SUBSCRIBE transport_bench"));
+        }
+        ~subscriber() { redisFree(c); }
+        bool receive(char* buf, size_t len, int timeout) {
+            if (timeout != timeout_ms) {
+                timeval tv { timeout / 1000, (timeout % 1000) * 1000 };
+                redisSetTimeout(c, tv);
+                timeout_ms = timeout;
+            }
+            void* r = nullptr;
+            if (redisGetReply(c, &r) != REDIS_OK || !r) return false;
+            auto* m  = static_cast<redisReply*>(r);
+            bool  ok = m->type == REDIS_REPLY_ARRAY && m->elements == 3 && m->element[2]->len == len;
+            if (ok) std::memcpy(buf, m->element[2]->str, len);
+            freeReplyObject(m);
+            return ok;
+        }
+    };
+};
+#endif
+
+template <typename Transport>
+void subscribe_loop(Transport& t, const run_t& r, int id, bench_shared_t* shared) {
+    typename Transport::subscriber sub(t, r, id);
+    auto&             stats = shared->subscribers[id];
+    std::vector<char> buf(r.payload);
+    bool              ready = false;
+
+    while (stats.received < config.messages) {
+        if (!sub.receive(buf.data(), r.payload, idle_timeout_ms)) {
+            if (shared->done.load(std::memory_order_acquire)) break;
+            continue;
+        }
+        auto now = steady_ns();
+        message_header_t h;
+        std::memcpy(&h, buf.data(), sizeof(h));
+        if (h.seq == warmup_seq) {
+            if (!ready) shared->ready.fetch_add(1);
+            ready = true;
+            continue;
+        }
+        stats.latency.record(now > h.sent ? now - h.sent : 0);
+        stats.received++;
+        stats.last_ns = now;
+    }
+}
+
+template <typename Transport>
+result_t run_transport(const run_t& r) {
+    auto* shared = static_cast<bench_shared_t*>(mmap(nullptr, sizeof(bench_shared_t), PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (shared == MAP_FAILED) throw std::runtime_error("mmap failed");
+    new (shared) bench_shared_t();
+
+    Transport t(r);
+    std::vector<std::thread> threads;
+    std::vector<pid_t>       children;
+    for (int i = 0; i < r.fanout; i++) {
+        if (Transport::threads_only) {
+            threads.emplace_back([&, i] { subscribe_loop(t, r, i, shared); });
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = 0;
+            try {
+                subscribe_loop(t, r, i, shared);
+            } catch (const std::exception& e) {
+                std::cerr << r.transport << " subscriber " << i << ": " << e.what() << "\n";
+                status = 1;
+            }
+            _exit(status);
+        }
+        if (pid < 0) throw std::runtime_error("fork failed");
+        children.push_back(pid);
+    }
+
+    result_t res { r, 0, 0, 0, {} };
+    try {
+        typename Transport::publisher pub(t, r);
+        std::vector<char> msg(r.payload, 0);
+        message_header_t  h { 0, warmup_seq };
+
+        // Warm up until every subscriber is connected and receiving; this
+        // also covers the PUB/SUB slow-joiner problem.
+        while (shared->ready.load() < r.fanout) {
+            h.sent = steady_ns();
+            std::memcpy(msg.data(), &h, sizeof(h));
+            pub.send(msg.data(), r.payload);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            for (auto pid : children)
+                if (waitpid(pid, nullptr, WNOHANG) == pid)
+                    throw std::runtime_error(r.transport + ": a subscriber failed to start");
+        }
+
+        std::uint64_t interval = config.rate > 0 ? static_cast<std::uint64_t>(1e9 / config.rate) : 0;
+        std::uint64_t start    = steady_ns();
+        std::uint64_t next     = start;
+        for (size_t i = 0; i < config.messages; i++) {
+            if (interval) {
+                while (steady_ns() < next) cpu_relax();
+            }
+            // When paced, stamp the scheduled send time so that a stalled
+            // publisher still shows up in the latency (coordinated omission).
+            h = { interval ? next : steady_ns(), i };
+            std::memcpy(msg.data(), &h, sizeof(h));
+            pub.send(msg.data(), r.payload);
+            next += interval;
+        }
+        std::uint64_t sent_at = steady_ns();
+        shared->done.store(true, std::memory_order_release);
+        res.send_rate = config.messages / ((sent_at - start) / 1e9);
+
+        for (auto& th : threads) th.join();
+        for (auto pid : children) waitpid(pid, nullptr, 0);
+
+        std::uint64_t last = start, received = 0;
+        for (int i = 0; i < r.fanout; i++) {
+            auto& s = shared->subscribers[i];
+            res.latency.merge(s.latency);
+            received += s.received;
+            last      = std::max(last, s.last_ns);
+        }
+        res.lost          = config.messages * r.fanout - received;
+        res.delivery_rate = last > start ? received / ((last - start) / 1e9) : 0;
+    } catch (...) {
+        // subscriber threads give up idle_timeout_ms after `done`
+        shared->done.store(true);
+        for (auto pid : children) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+        for (auto& th : threads) th.join();
+        munmap(shared, sizeof(bench_shared_t));
+        throw;
+    }
+    munmap(shared, sizeof(bench_shared_t));
+    return res;
+}
+
+template <template <size_t> class Transport>
+result_t run_sized(const run_t& r) {
+    switch (r.payload) {
+    case 16:   return run_transport<Transport<16>>(r);
+    case 64:   return run_transport<Transport<64>>(r);
+    case 256:  return run_transport<Transport<256>>(r);
+    case 1024: return run_transport<Transport<1024>>(r);
+    case 4096: return run_transport<Transport<4096>>(r);
+    }
+    throw std::invalid_argument("shm transports support payloads of 16, 64, 256, 1024 and 4096 bytes");
+}
+
+result_t run_one(const run_t& r) {
+    if (r.transport == "shm-queue")     return run_sized<shm_queue_transport>(r);
+    if (r.transport == "shm-broadcast") return run_sized<shm_broadcast_transport>(r);
+    if (r.transport == "pipe")          return run_transport<fd_transport<false>>(r);
+    if (r.transport == "uds")           return run_transport<fd_transport<true>>(r);
+#ifdef WITH_ZMQ
+    if (r.transport == "zmq-ipc")       return run_transport<zmq_kind_transport<0>>(r);
+    if (r.transport == "zmq-tcp")       return run_transport<zmq_kind_transport<1>>(r);
+    if (r.transport == "zmq-inproc")    return run_transport<zmq_kind_transport<2>>(r);
+#endif
+#ifdef WITH_HIREDIS
+    if (r.transport == "redis")         return run_transport<redis_transport>(r);
+#endif
+    throw std::invalid_argument("unknown or not compiled in transport: " + r.transport);
+}
+
+void print_csv_header() {
+    std::cout << "transport,payload,fanout,rate,messages,send_rate,delivery_rate,lost,"
+                 "p50_ns,p90_ns,p99_ns,p999_ns,max_ns,mean_ns\n";
+}
+
+void print_result(const result_t& r, bool first) {
+    const auto& l = r.latency;
+    if (config.format == "json") {
+        std::cout << (first ? "[\n" : ",\n")
+                  << "  {\"transport\": \"" << r.run.transport << "\", \"payload\": " << r.run.payload
+                  << ", \"fanout\": " << r.run.fanout << ", \"rate\": " << config.rate
+                  << ", \"messages\": " << config.messages << ", \"send_rate\": " << r.send_rate
+                  << ", \"delivery_rate\": " << r.delivery_rate << ", \"lost\": " << r.lost
+                  << ", \"p50_ns\": " << l.percentile(0.50) << ", \"p90_ns\": " << l.percentile(0.90)
+                  << ", \"p99_ns\": " << l.percentile(0.99) << ", \"p999_ns\": " << l.percentile(0.999)
+                  << ", \"max_ns\": " << l.max() << ", \"mean_ns\": " << l.mean() << "}";
+    } else {
+        std::cout << r.run.transport << "," << r.run.payload << "," << r.run.fanout << "," << config.rate << ","
+                  << config.messages << "," << r.send_rate << "," << r.delivery_rate << "," << r.lost << ","
+                  << l.percentile(0.50) << "," << l.percentile(0.90) << "," << l.percentile(0.99) << ","
+                  << l.percentile(0.999) << "," << l.max() << "," << l.mean() << "\n";
+    }
+    std::cout.flush();
+}
+
+template <typename T>
+std::vector<T> parse_list(const std::string& val, T (*convert)(const std::string&)) {
+    std::vector<T> out;
+    for (size_t pos = 0; pos < val.size(); ) {
+        size_t comma = val.find(',', pos);
+        out.push_back(convert(val.substr(pos, comma - pos)));
+        pos = comma == std::string::npos ? val.size() : comma + 1;
+    }
+    return out;
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [options]\n"
+              << "  --transports T1,T2,...     shm-queue, shm-broadcast, pipe, uds"
+#ifdef WITH_ZMQ
+              << ", zmq-ipc, zmq-tcp, zmq-inproc"
+#endif
+#ifdef WITH_HIREDIS
+              << ", redis"
+#endif
+              << "\n"
+              << "  --payloads B1,B2,...       message sizes in bytes (default 64; shm: 16, 64, 256, 1024, 4096)\n"
+              << "  --fanout N1,N2,...         subscribers per run (default 1)\n"
+              << "  --messages N               messages per run (default 1000000)\n"
+              << "  --rate R                   publisher msgs/sec (default unlimited)\n"
+              << "  --format csv|json          report format (default csv)\n"
+              << "  --redis HOST:PORT          redis server (default 127.0.0.1:6379)\n";
+    std::exit(2);
+}
+
+void parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key == "--help" || i + 1 >= argc) usage(argv[0]);
+        std::string val = argv[++i];
+
+        if      (key == "--transports") config.transports = parse_list<std::string>(val, [](const std::string& s) { return s; });
+        else if (key == "--payloads")   config.payloads   = parse_list<size_t>(val, [](const std::string& s) { return size_t(std::stoull(s)); });
+        else if (key == "--fanout")     config.fanouts    = parse_list<int>(val, [](const std::string& s) { return std::stoi(s); });
+        else if (key == "--messages")   config.messages   = std::stoull(val);
+        else if (key == "--rate")       config.rate       = std::stod(val);
+        else if (key == "--format")     config.format     = val;
+        else if (key == "--redis") {
+            auto colon = val.rfind(':');
+            config.redis_host = val.substr(0, colon);
+            if (colon != std::string::npos) config.redis_port = std::stoi(val.substr(colon + 1));
+        }
+        else usage(argv[0]);
+    }
+    for (auto p : config.payloads)
+        if (p < sizeof(message_header_t)) usage(argv[0]);
+    for (auto f : config.fanouts)
+        if (f < 1 || f > max_fanout) usage(argv[0]);
+    if (config.format != "csv" && config.format != "json") usage(argv[0]);
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    bool first = true;
+    if (config.format == "csv") print_csv_header();
+    for (auto& transport : config.transports) {
+        for (auto payload : config.payloads) {
+            for (auto fanout : config.fanouts) {
+                try {
+                    print_result(run_one({ transport, payload, fanout }), first);
+                    first = false;
+                } catch (const std::exception& e) {
+                    std::cerr << transport << " payload " << payload << " fanout " << fanout << ": " << e.what() << "\n";
+                }
+            }
+        }
+    }
+    if (config.format == "json") std::cout << (first ? "[]\n" : "\n]\n");
+    return 0;
+}